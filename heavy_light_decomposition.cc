@@ -3,12 +3,755 @@
 #include <algorithm>
 #include <numeric>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <deque>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <filesystem>
+
+#include "hld_c_api.h"
 
 using namespace std;
 
-// --- Segment Tree (for sum queries and point updates) ---
-class SegmentTree {
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define HLD_HAS_COROUTINES 1
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define HLD_HAS_SPAN 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HLD_PREFETCH(addr) __builtin_prefetch(addr)
+#define HLD_POPCOUNT64(x) __builtin_popcountll(x)
+#define HLD_CLZ64(x) __builtin_clzll(x)
+#define HLD_CTZ64(x) __builtin_ctzll(x)
+#else
+#define HLD_PREFETCH(addr) ((void)(addr))
+#define HLD_POPCOUNT64(x) hld_popcount64_portable(x)
+inline int hld_popcount64_portable(unsigned long long x) {
+    int count = 0;
+    for (; x; x &= x - 1) ++count;
+    return count;
+}
+#define HLD_CLZ64(x) hld_clz64_portable(x)
+// x must be nonzero, as for __builtin_clzll.
+inline int hld_clz64_portable(unsigned long long x) {
+    int count = 0;
+    for (; !(x >> 63); x <<= 1) ++count;
+    return count;
+}
+#define HLD_CTZ64(x) hld_ctz64_portable(x)
+// x must be nonzero, as for __builtin_ctzll.
+inline int hld_ctz64_portable(unsigned long long x) {
+    int count = 0;
+    for (; !(x & 1); x >>= 1) ++count;
+    return count;
+}
+#endif
+
+// --- Operation counters (used by tests to assert complexity bounds) ---
+struct HLDOpCounters {
+    unsigned long long chain_hops = 0;            // Light edges crossed by path/LCA walks
+    unsigned long long segment_nodes_visited = 0; // Segment tree nodes touched by range queries
+};
+
+/**
+ * @brief Returns the calling thread's operation counters.
+ *        Counting is compiled out when HLD_DISABLE_OP_COUNTERS is defined.
+ */
+inline HLDOpCounters& hld_op_counters() {
+    thread_local HLDOpCounters counters;
+    return counters;
+}
+
+#ifdef HLD_DISABLE_OP_COUNTERS
+#define HLD_COUNT_OP(field) ((void)0)
+#else
+#define HLD_COUNT_OP(field) (++hld_op_counters().field)
+#endif
+
+// --- Chrome trace-event recording ---
+class TraceRecorder {
+public:
+    static TraceRecorder& instance() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    /**
+     * @brief Records a completed span on the calling thread's track.
+     * @param name A string literal (the pointer is stored, not copied).
+     * @param start_us Start time in microseconds on the steady clock.
+     * @param duration_us Duration in microseconds.
+     */
+    void record(const char* name, long long start_us, long long duration_us) {
+        int thread_id = current_thread_id();
+        lock_guard<mutex> lock(events_mutex);
+        events.push_back({name, start_us, duration_us, thread_id});
+    }
+
+    size_t size() const {
+        lock_guard<mutex> lock(events_mutex);
+        return events.size();
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(events_mutex);
+        events.clear();
+    }
+
+    /**
+     * @brief Writes all recorded spans as Chrome trace-event JSON (complete "X" events, one track per thread),
+     *        loadable in chrome://tracing or Perfetto.
+     */
+    void write_chrome_trace(ostream& out) const {
+        lock_guard<mutex> lock(events_mutex);
+        out << "{\"traceEvents\":[";
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& e = events[i];
+            out << (i ? ",\n" : "\n") << "{\"name\":\"";
+            for (const char* c = e.name; *c; ++c) {
+                if (*c == '"' || *c == '\\') out << '\\';
+                out << *c;
+            }
+            out << "\",\"cat\":\"hld\",\"ph\":\"X\",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+                << ",\"pid\":1,\"tid\":" << e.thread_id << "}";
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+
+    bool write_chrome_trace_file(const string& path) const {
+        ofstream out(path);
+        write_chrome_trace(out);
+        return (bool)out;
+    }
+
+    static long long now_us() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct Event {
+        const char* name;
+        long long start_us;
+        long long duration_us;
+        int thread_id;
+    };
+
+    mutable mutex events_mutex;
+    vector<Event> events;
+
+    // Small sequential ids give stable, readable track numbers in the viewer.
+    static int current_thread_id() {
+        static atomic<int> next_id(1);
+        thread_local int id = next_id.fetch_add(1);
+        return id;
+    }
+};
+
+// Records the enclosing scope as one span. Use through HLD_TRACE_SCOPE.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name(name), start_us(TraceRecorder::now_us()) {}
+    ~TraceScope() {
+        TraceRecorder::instance().record(name, start_us, TraceRecorder::now_us() - start_us);
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    long long start_us;
+};
+
+#define HLD_TRACE_CONCAT_INNER(a, b) a##b
+#define HLD_TRACE_CONCAT(a, b) HLD_TRACE_CONCAT_INNER(a, b)
+
+// Tracing is compiled in only with HLD_ENABLE_TRACING; otherwise HLD_TRACE_SCOPE expands to nothing.
+#ifdef HLD_ENABLE_TRACING
+#define HLD_TRACE_SCOPE(name) TraceScope HLD_TRACE_CONCAT(hld_trace_scope_, __LINE__)(name)
+#else
+#define HLD_TRACE_SCOPE(name) ((void)0)
+#endif
+
+// --- Metrics registry with Prometheus text exposition ---
+static constexpr int kMetricShards = 16; // Threads are spread round-robin over this many cache-line shards
+
+/**
+ * @brief Returns the calling thread's shard index, assigned round-robin on first use.
+ */
+inline int metric_shard_index() {
+    static atomic<int> next_thread(0);
+    thread_local int shard = next_thread.fetch_add(1) % kMetricShards;
+    return shard;
+}
+
+class ShardedCounter {
+public:
+    void add(uint64_t n = 1) {
+        shards[metric_shard_index()].value.fetch_add(n, memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Shard& shard : shards) total += shard.value.load(memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> value{0};
+    };
+    Shard shards[kMetricShards];
+};
+
+class LatencyHistogram {
+public:
+    static constexpr int kBuckets = 12;
+
+    // Upper bounds in seconds, 100ns to 100ms.
+    static const double* bucket_bounds() {
+        static const double bounds[kBuckets] = {1e-7, 2.5e-7, 5e-7, 1e-6, 2.5e-6, 5e-6,
+                                                1e-5, 1e-4, 1e-3, 1e-2, 5e-2, 1e-1};
+        return bounds;
+    }
+
+    void observe_ns(uint64_t ns) {
+        double seconds = ns * 1e-9;
+        int bucket = 0;
+        while (bucket < kBuckets && seconds > bucket_bounds()[bucket]) ++bucket;
+        Shard& shard = shards[metric_shard_index()];
+        shard.buckets[bucket].fetch_add(1, memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, memory_order_relaxed);
+    }
+
+    /**
+     * @brief Returns per-bucket (non-cumulative) counts; the last entry counts observations above every bound.
+     */
+    vector<uint64_t> bucket_counts() const {
+        vector<uint64_t> counts(kBuckets + 1, 0);
+        for (const Shard& shard : shards) {
+            for (int b = 0; b <= kBuckets; ++b) counts[b] += shard.buckets[b].load(memory_order_relaxed);
+        }
+        return counts;
+    }
+
+    uint64_t sum_ns() const {
+        uint64_t total = 0;
+        for (const Shard& shard : shards) total += shard.sum_ns.load(memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> buckets[kBuckets + 1] = {};
+        atomic<uint64_t> sum_ns{0};
+    };
+    Shard shards[kMetricShards];
+};
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    /**
+     * @brief Returns the counter with this name, registering it on first use.
+     *        The reference stays valid for the registry's lifetime, so hot paths can cache it.
+     */
+    ShardedCounter& counter(const string& name, const string& help) {
+        return *find_or_add(name, help, Metric::kCounter).counter;
+    }
+
+    LatencyHistogram& histogram(const string& name, const string& help) {
+        return *find_or_add(name, help, Metric::kHistogram).histogram;
+    }
+
+    void set_gauge(const string& name, const string& help, double value) {
+        lock_guard<mutex> lock(metrics_mutex);
+        find_or_add_locked(name, help, Metric::kGauge).gauge = value;
+    }
+
+    /**
+     * @brief Renders every metric in the Prometheus text exposition format (version 0.0.4),
+     *        in registration order.
+     */
+    string render_prometheus() const {
+        lock_guard<mutex> lock(metrics_mutex);
+        ostringstream out;
+        out.precision(17);
+        for (const auto& metric : metrics) {
+            out << "# HELP " << metric->name << " " << metric->help << "\n";
+            switch (metric->kind) {
+                case Metric::kCounter:
+                    out << "# TYPE " << metric->name << " counter\n";
+                    out << metric->name << " " << metric->counter->value() << "\n";
+                    break;
+                case Metric::kGauge:
+                    out << "# TYPE " << metric->name << " gauge\n";
+                    out << metric->name << " " << metric->gauge << "\n";
+                    break;
+                case Metric::kHistogram: {
+                    out << "# TYPE " << metric->name << " histogram\n";
+                    vector<uint64_t> counts = metric->histogram->bucket_counts();
+                    uint64_t cumulative = 0;
+                    for (int b = 0; b < LatencyHistogram::kBuckets; ++b) {
+                        cumulative += counts[b];
+                        ostringstream le; // Default precision keeps labels short ("2.5e-07", not 2.4999...e-07)
+                        le << LatencyHistogram::bucket_bounds()[b];
+                        out << metric->name << "_bucket{le=\"" << le.str() << "\"} " << cumulative << "\n";
+                    }
+                    cumulative += counts[LatencyHistogram::kBuckets];
+                    out << metric->name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+                    out << metric->name << "_sum " << metric->histogram->sum_ns() * 1e-9 << "\n";
+                    out << metric->name << "_count " << cumulative << "\n";
+                    break;
+                }
+            }
+        }
+        return out.str();
+    }
+
+    /**
+     * @brief Writes render_prometheus() to path via a temporary file and rename, so a scraper
+     *        (e.g. node_exporter's textfile collector) never sees a partial file.
+     * @return true on success.
+     */
+    bool write_prometheus_file(const string& path) const {
+        string tmp_path = path + ".tmp";
+        {
+            ofstream out(tmp_path);
+            out << render_prometheus();
+            if (!out) return false;
+        }
+        return rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    struct Metric {
+        enum Kind { kCounter, kGauge, kHistogram };
+        string name;
+        string help;
+        Kind kind;
+        unique_ptr<ShardedCounter> counter;
+        unique_ptr<LatencyHistogram> histogram;
+        double gauge = 0;
+    };
+
+    mutable mutex metrics_mutex;
+    vector<unique_ptr<Metric>> metrics;
+
+    Metric& find_or_add(const string& name, const string& help, Metric::Kind kind) {
+        lock_guard<mutex> lock(metrics_mutex);
+        return find_or_add_locked(name, help, kind);
+    }
+
+    Metric& find_or_add_locked(const string& name, const string& help, Metric::Kind kind) {
+        for (auto& metric : metrics) {
+            if (metric->name == name) {
+                assert(metric->kind == kind);
+                return *metric;
+            }
+        }
+        unique_ptr<Metric> metric(new Metric());
+        metric->name = name;
+        metric->help = help;
+        metric->kind = kind;
+        if (kind == Metric::kCounter) metric->counter.reset(new ShardedCounter());
+        if (kind == Metric::kHistogram) metric->histogram.reset(new LatencyHistogram());
+        metrics.push_back(move(metric));
+        return *metrics.back();
+    }
+};
+
+// The HLD operation metrics, registered on first use.
+struct HLDMetrics {
+    ShardedCounter& query_path_total;
+    ShardedCounter& get_lca_total;
+    ShardedCounter& update_total;
+    LatencyHistogram& query_path_seconds;
+    LatencyHistogram& get_lca_seconds;
+    LatencyHistogram& update_seconds;
+
+    static HLDMetrics& get() {
+        static HLDMetrics metrics = create(MetricsRegistry::instance());
+        return metrics;
+    }
+
+private:
+    static HLDMetrics create(MetricsRegistry& r) {
+        return {r.counter("hld_query_path_total", "Path queries answered, including batch items."),
+                r.counter("hld_get_lca_total", "LCA queries answered, including batch items."),
+                r.counter("hld_update_total", "Node value updates applied, including batch items."),
+                r.histogram("hld_query_path_duration_seconds", "Latency of single query_path calls."),
+                r.histogram("hld_get_lca_duration_seconds", "Latency of single get_lca calls."),
+                r.histogram("hld_update_duration_seconds", "Latency of single update_node_value calls.")};
+    }
+};
+
+// Counts one operation and observes its latency when the scope ends.
+class MetricsScope {
+public:
+    MetricsScope(ShardedCounter& counter, LatencyHistogram& histogram)
+        : histogram(histogram), start(chrono::steady_clock::now()) {
+        counter.add();
+    }
+    ~MetricsScope() {
+        histogram.observe_ns(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    LatencyHistogram& histogram;
+    chrono::steady_clock::time_point start;
+};
+
+// Metrics are compiled in only with HLD_ENABLE_METRICS; otherwise these expand to nothing.
+#ifdef HLD_ENABLE_METRICS
+#define HLD_METRICS_SCOPE(op) \
+    MetricsScope HLD_TRACE_CONCAT(hld_metrics_scope_, __LINE__)(HLDMetrics::get().op##_total, HLDMetrics::get().op##_seconds)
+#define HLD_METRICS_COUNT(op, n) HLDMetrics::get().op##_total.add(n)
+#else
+#define HLD_METRICS_SCOPE(op) ((void)0)
+#define HLD_METRICS_COUNT(op, n) ((void)0)
+#endif
+
+// --- Segment tree monoids ---
+// A monoid supplies value_type, identity() and an associative combine(). Path queries combine
+// chain segments in walk order rather than path order, so monoids used with HLD must be commutative.
+struct SumMonoid {
+    using value_type = int;
+    static int identity() { return 0; }
+    static int combine(int a, int b) { return a + b; }
+};
+
+struct BitOrMonoid {
+    using value_type = uint64_t;
+    static uint64_t identity() { return 0; }
+    static uint64_t combine(uint64_t a, uint64_t b) { return a | b; }
+};
+
+struct BitAndMonoid {
+    using value_type = uint64_t;
+    static uint64_t identity() { return ~0ULL; }
+    static uint64_t combine(uint64_t a, uint64_t b) { return a & b; }
+};
+
+/**
+ * @brief The (up to) K largest keys of a range, sorted in descending order.
+ */
+template <int K>
+struct TopKList {
+    int count;
+    int64_t keys[K];
+};
+
+template <int K>
+struct TopKMonoid {
+    using value_type = TopKList<K>;
+
+    static value_type identity() {
+        value_type list;
+        list.count = 0;
+        return list;
+    }
+
+    // Named apart from single(int): a key packs the value with its node id (see PathTopKIndex).
+    static value_type single_key(int64_t key) {
+        value_type list;
+        list.count = 1;
+        list.keys[0] = key;
+        return list;
+    }
+
+    /**
+     * @brief Merges two descending lists, keeping the K largest keys.
+     *        The loop body is branch-free (selects instead of jumps), so its cost does not depend on how the
+     *        two inputs interleave.
+     */
+    static value_type combine(const value_type& a, const value_type& b) {
+        value_type out;
+        out.count = min(K, a.count + b.count);
+        int i = 0, j = 0;
+        for (int k = 0; k < out.count; ++k) {
+            int64_t x = (i < a.count) ? a.keys[i] : INT64_MIN;
+            int64_t y = (j < b.count) ? b.keys[j] : INT64_MIN;
+            bool take_a = (j >= b.count) || (i < a.count && x >= y);
+            out.keys[k] = take_a ? x : y;
+            i += take_a;
+            j += !take_a;
+        }
+        return out;
+    }
+};
+
+/**
+ * @brief A HyperLogLog sketch with 2^P one-byte registers.
+ */
+template <int P>
+struct HyperLogLogSketch {
+    static_assert(4 <= P && P <= 16, "HyperLogLog precision must be in [4, 16]");
+    static constexpr int kRegisters = 1 << P;
+    uint8_t registers[kRegisters];
+
+    void add(int value) {
+        uint64_t h = (uint64_t)(uint32_t)value + 0x9E3779B97F4A7C15ULL; // splitmix64 finalizer
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+        uint64_t rest = h << P;
+        uint8_t rank = (uint8_t)(rest ? HLD_CLZ64(rest) + 1 : 64 - P + 1);
+        uint8_t& reg = registers[h >> (64 - P)];
+        if (rank > reg) reg = rank;
+    }
+
+    /**
+     * @brief Estimates the number of distinct values added, with linear counting for small cardinalities.
+     *        The relative standard error is about 1.04 / sqrt(2^P).
+     */
+    double estimate() const {
+        const double m = kRegisters;
+        double alpha = (P == 4) ? 0.673 : (P == 5) ? 0.697 : (P == 6) ? 0.709 : 0.7213 / (1.0 + 1.079 / m);
+        double inverse_sum = 0;
+        int zeros = 0;
+        for (int i = 0; i < kRegisters; ++i) {
+            inverse_sum += ldexp(1.0, -registers[i]);
+            zeros += (registers[i] == 0);
+        }
+        double raw = alpha * m * m / inverse_sum;
+        if (raw <= 2.5 * m && zeros > 0) return m * log(m / zeros);
+        return raw;
+    }
+};
+
+template <int P>
+struct HyperLogLogMonoid {
+    using value_type = HyperLogLogSketch<P>;
+
+    static value_type identity() {
+        value_type sketch;
+        fill(sketch.registers, sketch.registers + value_type::kRegisters, (uint8_t)0);
+        return sketch;
+    }
+
+    static value_type single(int value) {
+        value_type sketch = identity();
+        sketch.add(value);
+        return sketch;
+    }
+
+    // Register-wise max over a fixed-length byte array; compilers vectorize this loop.
+    static value_type combine(const value_type& a, const value_type& b) {
+        value_type out;
+        for (int i = 0; i < value_type::kRegisters; ++i) {
+            out.registers[i] = max(a.registers[i], b.registers[i]);
+        }
+        return out;
+    }
+};
+
+/**
+ * @brief A merging t-digest with at most C centroids, sorted by mean. Centroids near the tails are kept
+ *        small (k1 scale function), so extreme quantiles are more accurate than the median.
+ */
+template <int C>
+struct QuantileSketch {
+    static_assert(C >= 4, "QuantileSketch needs at least 4 centroids");
+    int count;
+    uint32_t total_weight;
+    int min_value, max_value;
+    double means[C];
+    uint32_t weights[C];
+
+    /**
+     * @brief Estimates the value at quantile q in [0, 1] by interpolating between centroid centers.
+     *        The sketch must be non-empty.
+     */
+    double quantile(double q) const {
+        assert(count > 0);
+        double target = min(max(q, 0.0), 1.0) * total_weight;
+        double left_weight = weights[0] / 2.0;
+        if (target <= left_weight) {
+            return (weights[0] == 1) ? means[0] : min_value + (means[0] - min_value) * target / left_weight;
+        }
+        double center = left_weight;
+        for (int i = 0; i + 1 < count; ++i) {
+            double next_center = center + (weights[i] + weights[i + 1]) / 2.0;
+            if (target <= next_center) {
+                return means[i] + (means[i + 1] - means[i]) * (target - center) / (next_center - center);
+            }
+            center = next_center;
+        }
+        double right_weight = weights[count - 1] / 2.0;
+        if (weights[count - 1] == 1) return means[count - 1];
+        return means[count - 1] + (max_value - means[count - 1]) * min(1.0, (target - center) / right_weight);
+    }
+};
+
+template <int C>
+struct QuantileSketchMonoid {
+    using value_type = QuantileSketch<C>;
+
+    static value_type identity() {
+        value_type sketch;
+        sketch.count = 0;
+        sketch.total_weight = 0;
+        sketch.min_value = numeric_limits<int>::max();
+        sketch.max_value = numeric_limits<int>::min();
+        return sketch;
+    }
+
+    static value_type single(int value) {
+        value_type sketch;
+        sketch.count = 1;
+        sketch.total_weight = 1;
+        sketch.min_value = sketch.max_value = value;
+        sketch.means[0] = value;
+        sketch.weights[0] = 1;
+        return sketch;
+    }
+
+    /**
+     * @brief Merges the two centroid lists by mean, then greedily folds neighbours while the result stays
+     *        within one unit of the k1 scale. A compression of C - 1 bounds the output by C centroids.
+     */
+    static value_type combine(const value_type& a, const value_type& b) {
+        if (a.count <= 0) return b;
+        if (b.count <= 0) return a;
+        double merged_means[2 * C];
+        uint32_t merged_weights[2 * C];
+        int n = 0, i = 0, j = 0;
+        while (i < a.count || j < b.count) {
+            bool take_a = (j >= b.count) || (i < a.count && a.means[i] <= b.means[j]);
+            merged_means[n] = take_a ? a.means[i] : b.means[j];
+            merged_weights[n] = take_a ? a.weights[i] : b.weights[j];
+            i += take_a;
+            j += !take_a;
+            ++n;
+        }
+
+        value_type out;
+        out.total_weight = a.total_weight + b.total_weight;
+        out.min_value = min(a.min_value, b.min_value);
+        out.max_value = max(a.max_value, b.max_value);
+        const double total = out.total_weight;
+        out.count = 0;
+        double cur_mean = merged_means[0];
+        uint32_t cur_weight = merged_weights[0];
+        double weight_before = 0;
+        double q_limit = q_limit_after(0);
+        for (int k = 1; k < n; ++k) {
+            double q = (weight_before + cur_weight + merged_weights[k]) / total;
+            if (q <= q_limit || out.count == C - 1) {
+                uint32_t w = cur_weight + merged_weights[k];
+                cur_mean += (merged_means[k] - cur_mean) * merged_weights[k] / w;
+                cur_weight = w;
+            } else {
+                out.means[out.count] = cur_mean;
+                out.weights[out.count] = cur_weight;
+                ++out.count;
+                weight_before += cur_weight;
+                q_limit = q_limit_after(weight_before / total);
+                cur_mean = merged_means[k];
+                cur_weight = merged_weights[k];
+            }
+        }
+        out.means[out.count] = cur_mean;
+        out.weights[out.count] = cur_weight;
+        ++out.count;
+        return out;
+    }
+
+private:
+    // Largest quantile reachable from q within one unit of k(q) = delta / (2 pi) * asin(2q - 1).
+    static double q_limit_after(double q) {
+        const double pi = 3.14159265358979323846;
+        const double delta = C - 1;
+        double k = delta / (2 * pi) * asin(2 * q - 1) + 1;
+        if (k >= delta / 4) return 1.0;
+        return (sin(2 * pi * k / delta) + 1) / 2;
+    }
+};
+
+/**
+ * @brief A linear basis over GF(2) of B-bit values: basis[i] is zero or has bit i as its highest set bit.
+ */
+template <int B>
+struct XorBasis {
+    static_assert(1 <= B && B <= 64, "XorBasis supports up to 64-bit values");
+    uint64_t basis[B];
+
+    /** @brief Gaussian insertion; returns false if x was already in the span. */
+    bool insert(uint64_t x) {
+        for (int i = B - 1; i >= 0 && x; --i) {
+            if (!((x >> i) & 1)) continue;
+            if (!basis[i]) {
+                basis[i] = x;
+                return true;
+            }
+            x ^= basis[i];
+        }
+        return false;
+    }
+
+    /** @brief The largest XOR of any subset of the inserted values (0 for the empty subset). */
+    uint64_t max_xor() const {
+        uint64_t best = 0;
+        for (int i = B - 1; i >= 0; --i) best = max(best, best ^ basis[i]);
+        return best;
+    }
+};
+
+template <int B>
+struct XorBasisMonoid {
+    using value_type = XorBasis<B>;
+
+    static value_type identity() {
+        value_type out;
+        fill(out.basis, out.basis + B, 0ULL);
+        return out;
+    }
+
+    // Node values are read as unsigned 32-bit words, so negative values do not set bits above 31.
+    static value_type single(int value) {
+        value_type out = identity();
+        out.insert((uint32_t)value);
+        return out;
+    }
+
+    static value_type combine(const value_type& a, const value_type& b) {
+        value_type out = a;
+        for (int i = B - 1; i >= 0; --i) {
+            if (b.basis[i]) out.insert(b.basis[i]);
+        }
+        return out;
+    }
+};
+
+// --- Segment Tree (for monoid range queries and point updates) ---
+template <typename Monoid>
+class BasicSegmentTree {
 public:
+    using T = typename Monoid::value_type;
+
     /**
      * @brief Constructs a new Segment Tree object.
      * 
@@ -16,8 +759,8 @@ public:
      *
      * @note Space complexity: O(size) for storing the tree (typically 4*size).
      */
-    SegmentTree(int size) : n(size) {
-        tree.resize(4 * n, 0);
+    BasicSegmentTree(int size) : n(size) {
+        tree.resize(4 * n, Monoid::identity());
     }
 
     /**
@@ -27,7 +770,7 @@ public:
      *
      * @note Time complexity: O(size), where size is the size of the segment tree (N nodes).
      */
-    void build_from_mapped_values(const vector<int>& values_at_pos) {
+    void build_from_mapped_values(const vector<T>& values_at_pos) {
         if (values_at_pos.empty()) {
             return; 
         }
@@ -42,38 +785,41 @@ public:
      *
      * @note Time complexity: O(log size), where size is the size of the segment tree (N nodes).
      */
-    void update(int index, int value) {
+    void update(int index, const T& value) {
         update(0, 0, n - 1, index, value);
     }
 
     /**
-     * @brief Queries the sum of values in a given range [query_left, query_right].
+     * @brief Queries the combined value of the range [query_left, query_right].
      * 
      * @param query_left The starting index of the query range.
      * @param query_right The ending index of the query range.
-     * @return The sum of values in the specified range.
+     * @return The combined value of the specified range (identity for an empty range).
      *
      * @note Time complexity: O(log size), where size is the size of the segment tree (N nodes).
      */
-    int query(int query_left, int query_right) {
-        if (query_left > query_right) return 0;
+    T query(int query_left, int query_right) const {
+        if (query_left > query_right) return Monoid::identity();
         return query(0, 0, n - 1, query_left, query_right);
     }
 
+    size_t memory_bytes() const {
+        return tree.capacity() * sizeof(T);
+    }
+
 private:
     int n; // Size of the original array/flattened tree array
-    vector<int> tree; // Stores the segment tree nodes
+    vector<T> tree; // Stores the segment tree nodes
 
     /**
-     * @brief Combines the results of two segment tree nodes.
-     *        For this sum segment tree, it simply adds the values.
+     * @brief Combines the results of two segment tree nodes using the monoid.
      * 
      * @param a Value from the left child node.
      * @param b Value from the right child node.
-     * @return The combined value (sum).
+     * @return The combined value.
      */
-    int combine(int a, int b) {
-        return a + b;
+    static T combine(const T& a, const T& b) {
+        return Monoid::combine(a, b);
     }
 
     /**
@@ -84,7 +830,7 @@ private:
      * @param start The starting index of the current segment.
      * @param end The ending index of the current segment.
      */
-    void build(const vector<int>& arr, int node, int start, int end) {
+    void build(const vector<T>& arr, int node, int start, int end) {
         if (start == end) {
             tree[node] = arr[start];
         } else {
@@ -104,7 +850,7 @@ private:
      * @param idx The index to update in the original array's mapping.
      * @param val The new value for the index.
      */
-    void update(int node, int start, int end, int idx, int val) {
+    void update(int node, int start, int end, int idx, const T& val) {
         if (start == end) {
             tree[node] = val;
         } else {
@@ -119,29 +865,65 @@ private:
     }
 
     /**
-     * @brief Recursive helper function to query the sum in a range [l, r].
+     * @brief Recursive helper function to query the combined value in a range [l, r].
      * 
      * @param node The current node index in the segment tree array.
      * @param start The starting index of the current segment.
      * @param end The ending index of the current segment.
      * @param l The left boundary of the query range.
      * @param r The right boundary of the query range.
-     * @return The sum of values in the specified range.
+     * @return The combined value of the specified range.
      */
-    int query(int node, int start, int end, int l, int r) {
+    T query(int node, int start, int end, int l, int r) const {
+        HLD_COUNT_OP(segment_nodes_visited);
         if (r < start || end < l) {
-            return 0;
+            return Monoid::identity();
         }
         if (l <= start && end <= r) {
             return tree[node];
         }
         int mid = (start + end) / 2;
-        int p1 = query(2 * node + 1, start, mid, l, r);
-        int p2 = query(2 * node + 2, mid + 1, end, l, r);
+        T p1 = query(2 * node + 1, start, mid, l, r);
+        T p2 = query(2 * node + 2, mid + 1, end, l, r);
         return combine(p1, p2);
     }
 };
 
+using SegmentTree = BasicSegmentTree<SumMonoid>;
+
+#ifdef HLD_HAS_COROUTINES
+class PathQueryAwaitable;
+#endif
+
+// --- Concurrent edge ingestion ---
+class EdgeIngestor {
+public:
+    /**
+     * @brief Creates one private edge buffer per loader thread. Hand the ingestor to HLD::ingest once all
+     *        loaders have finished.
+     */
+    explicit EdgeIngestor(int num_loaders) : buffers(num_loaders) {}
+
+    /**
+     * @brief Appends an undirected edge to the buffer of `loader`. Safe to call concurrently as long as each
+     *        thread uses its own loader index; buffers are cache-line aligned so loaders do not share lines.
+     * @note Time complexity: amortized O(1).
+     */
+    void add_edge(int loader, int u, int v) {
+        buffers[loader].edges.push_back({u, v});
+    }
+
+    int num_loaders() const { return (int)buffers.size(); }
+
+private:
+    friend class HLD;
+
+    struct alignas(64) LoaderBuffer {
+        vector<pair<int, int>> edges;
+    };
+    vector<LoaderBuffer> buffers;
+};
+
 // --- Heavy-Light Decomposition Class ---
 class HLD {
 public:
@@ -153,7 +935,7 @@ public:
      */
     HLD(int num_nodes, const vector<int>& node_initial_values)
         : N(num_nodes),
-          adj(num_nodes),
+          edge_buffers(1),
           values(node_initial_values),
           parent(num_nodes, -1),
           depth(num_nodes, 0),
@@ -162,7 +944,8 @@ public:
           head(num_nodes),
           pos(num_nodes),
           cur_pos(0),
-          seg_tree(num_nodes) {
+          seg_tree(num_nodes),
+          batch_width(kDefaultBatchWidth) {
     }
 
     /**
@@ -173,26 +956,119 @@ public:
      * @param v The second node.
      */
     void add_edge(int u, int v) {
-        adj[u].push_back(v);
-        adj[v].push_back(u);
+        edge_buffers[0].push_back({u, v});
+    }
+
+    /**
+     * @brief Takes over the edge buffers of an ingestor whose loaders have all finished. build() merges every
+     *        buffer into the flat adjacency in parallel. Adjacency order, and so the decomposition, is the same
+     *        as calling add_edge for the edges added so far, then for each loader's edges in loader order.
+     * @note Time complexity: O(number of loaders); the edges themselves are moved, not copied.
+     */
+    void ingest(EdgeIngestor& ingestor) {
+        for (EdgeIngestor::LoaderBuffer& buffer : ingestor.buffers) {
+            edge_buffers.push_back(move(buffer.edges));
+            buffer.edges.clear();
+        }
     }
 
     /**
      * @brief Builds the Heavy-Light Decomposition structure and the underlying segment tree.
      *        Call this after adding all edges.
      * @param root The root node of the tree.
+     * @return false if the edges do not form a tree containing every node (a cycle, a repeated edge, a self-loop
+     *         or a disconnected node); the object is then unusable.
      * @note Time complexity: O(N) for DFS1 and DFS2 + O(N) for segment tree build = O(N)
      * @note Space complexity: O(N) for various vectors and the segment tree
      */
-    void build(int root) {
-        dfs1_size_depth_parent(root, -1, 0);
-        dfs2_hld(root, root);
+    bool build(int root) {
+        HLD_TRACE_SCOPE("HLD::build");
+        {
+            HLD_TRACE_SCOPE("build_adjacency");
+            build_adjacency();
+        }
+        {
+            HLD_TRACE_SCOPE("dfs1_size_depth_parent");
+            if (!dfs1_size_depth_parent(root)) return false;
+        }
+        {
+            HLD_TRACE_SCOPE("dfs2_hld");
+            dfs2_hld(root);
+        }
+
+        vector<int> values_for_seg_tree(N);
+        {
+            HLD_TRACE_SCOPE("value_scatter");
+            for (int i = 0; i < N; ++i) {
+                values_for_seg_tree[pos[i]] = values[i];
+            }
+        }
+        HLD_TRACE_SCOPE("segment_tree_build");
+        seg_tree.build_from_mapped_values(values_for_seg_tree);
+        return true;
+    }
+
+    /**
+     * @brief Builds the decomposition directly from a heavy-first preorder, without adjacency lists or DFS.
+     *        In a heavy-first preorder the first child visited is the heavy child, so node order[k+1] is the
+     *        heavy child of order[k] exactly when it is a child of it; heads, depths and subtree sizes follow
+     *        from linear scans. Use instead of add_edge/build.
+     * @param order order[k] is the node placed at pos k; order[0] is the root.
+     * @param parent_of The parent of every node, -1 for the root only.
+     * @return false if the input is not a heavy-first preorder of a tree; the object is then unusable.
+     *
+     * @note Time complexity: O(N).
+     */
+    bool build_from_preorder(const vector<int>& order, const vector<int>& parent_of) {
+        HLD_TRACE_SCOPE("HLD::build_from_preorder");
+        if ((int)order.size() != N || (int)parent_of.size() != N || N == 0) return false;
+        fill(pos.begin(), pos.end(), -1);
+        for (int k = 0; k < N; ++k) {
+            int u = order[k];
+            if (u < 0 || u >= N || pos[u] != -1) return false;
+            pos[u] = k;
+        }
+
+        // Each node's parent must be on the current root path (the stack) for order to be a preorder.
+        vector<int> stack;
+        for (int k = 0; k < N; ++k) {
+            int u = order[k], p = parent_of[u];
+            if ((k == 0) != (p == -1)) return false;
+            while (!stack.empty() && stack.back() != p) stack.pop_back();
+            if (k > 0 && stack.empty()) return false;
+            stack.push_back(u);
+
+            parent[u] = p;
+            heavy_child[u] = -1;
+            subtree_size[u] = 1;
+            if (k == 0) {
+                depth[u] = 0;
+                head[u] = u;
+            } else if (order[k - 1] == p) {
+                depth[u] = depth[p] + 1;
+                heavy_child[p] = u;
+                head[u] = head[p];
+            } else {
+                depth[u] = depth[p] + 1;
+                head[u] = u;
+            }
+        }
+
+        for (int k = N - 1; k > 0; --k) {
+            subtree_size[parent_of[order[k]]] += subtree_size[order[k]];
+        }
+        for (int k = 1; k < N; ++k) {
+            int u = order[k];
+            if (subtree_size[u] > subtree_size[heavy_child[parent_of[u]]]) return false;
+        }
+        cur_pos = N;
 
         vector<int> values_for_seg_tree(N);
         for (int i = 0; i < N; ++i) {
             values_for_seg_tree[pos[i]] = values[i];
         }
         seg_tree.build_from_mapped_values(values_for_seg_tree);
+        return true;
     }
 
     /**
@@ -204,6 +1080,7 @@ public:
      * @note Time complexity: O(log N) due to segment tree update.
      */
     void update_node_value(int u, int new_value) {
+        HLD_METRICS_SCOPE(update);
         values[u] = new_value;
         seg_tree.update(pos[u], new_value);
     }
@@ -216,23 +1093,37 @@ public:
      *
      * @note Time complexity: O(log^2 N) in the worst case (path crossing many heavy paths).
      */
-    int query_path(int u, int v) {
+    int query_path(int u, int v) const {
+        HLD_METRICS_SCOPE(query_path);
         int result = 0;
+        for_each_path_segment(u, v, [&](int l, int r) {
+            result += seg_tree.query(l, r);
+        });
+        return result;
+    }
 
+    /**
+     * @brief Calls f(l, r) for every maximal `pos` interval [l, r] on the path between u and v.
+     *        Indexes that keep their own segment tree over `pos` order reuse the chain walk through this.
+     * @param u The first node.
+     * @param v The second node.
+     * @param f Callback invoked with O(log N) intervals, in walk order (not path order).
+     */
+    template <typename F>
+    void for_each_path_segment(int u, int v, F&& f) const {
         while (head[u] != head[v]) {
             if (depth[head[u]] < depth[head[v]]) {
                 swap(u, v);
             }
-            result += seg_tree.query(pos[head[u]], pos[u]);
+            f(pos[head[u]], pos[u]);
             u = parent[head[u]];
+            HLD_COUNT_OP(chain_hops);
         }
 
         if (depth[u] > depth[v]) {
             swap(u, v);
         }
-        result += seg_tree.query(pos[u], pos[v]);
-        
-        return result;
+        f(pos[u], pos[v]);
     }
 
     /**
@@ -243,163 +1134,4457 @@ public:
      *
      * @note Time complexity: O(log N).
      */
-    int get_lca(int u, int v) {
+    int get_lca(int u, int v) const {
+        HLD_METRICS_SCOPE(get_lca);
         while (head[u] != head[v]) {
             if (depth[head[u]] < depth[head[v]]) {
                 swap(u, v);
             }
             u = parent[head[u]];
+            HLD_COUNT_OP(chain_hops);
         }
         return (depth[u] < depth[v]) ? u : v;
     }
 
-
-private:
+    /**
+     * @brief Answers many path-sum queries in one call.
+     *        Up to get_batch_width() queries are walked in lockstep so that the chain hops of
+     *        independent queries overlap, and each hop prefetches the next node's metadata.
+     * @param pairs Flat array of endpoints {u0, v0, u1, v1, ...}.
+     * @param count The number of queries.
+     * @param results Output array with room for count values.
+     *
+     * @note Time complexity: O(count * log^2 N).
+     */
+    void query_path_batch(const int* pairs, size_t count, int* results) {
+        HLD_TRACE_SCOPE("HLD::query_path_batch");
+        HLD_METRICS_COUNT(query_path, count);
+        walk_batch(pairs, count, results, true);
+    }
+
+#ifdef HLD_HAS_COROUTINES
+    /**
+     * @brief Asynchronous path-sum query for coroutine callers: `int s = co_await hld.query_path_async(u, v);`
+     *        The request is queued in the calling thread's PathQueryBatcher and answered, together with
+     *        every other queued request, by query_path_batch when the batcher is flushed.
+     * @param u The first node.
+     * @param v The second node.
+     * @return An awaitable yielding the sum of values on the path between u and v.
+     */
+    PathQueryAwaitable query_path_async(int u, int v);
+#endif
+
+    /**
+     * @brief Finds the LCA for many node pairs in one call, walked like query_path_batch.
+     * @param pairs Flat array of node pairs {u0, v0, u1, v1, ...}.
+     * @param count The number of pairs.
+     * @param results Output array with room for count node indices.
+     *
+     * @note Time complexity: O(count * log N).
+     */
+    void get_lca_batch(const int* pairs, size_t count, int* results) {
+        HLD_TRACE_SCOPE("HLD::get_lca_batch");
+        HLD_METRICS_COUNT(get_lca, count);
+        walk_batch(pairs, count, results, false);
+    }
+
+    /**
+     * @brief Applies many point assignments in order.
+     * @param updates Flat array {node0, value0, node1, value1, ...}.
+     * @param count The number of updates.
+     *
+     * @note Time complexity: O(count * log N).
+     */
+    void update_node_values_batch(const int* updates, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            update_node_value(updates[2 * i], updates[2 * i + 1]);
+        }
+    }
+
+    /**
+     * @brief Finds the LCA of a non-empty set of nodes.
+     *        In `pos` (preorder) the LCA of a set equals the LCA of its min-`pos` and max-`pos` members, so a
+     *        single scan replaces count-1 pairwise get_lca calls. The scan reduces (pos << 32 | node) keys
+     *        with plain min/max, which compilers vectorise.
+     * @param nodes The nodes of the set (duplicates allowed).
+     * @param count The number of nodes, at least 1.
+     * @return The index of the LCA node.
+     *
+     * @note Time complexity: O(count + log N).
+     */
+    int lca_of_set(const int* nodes, size_t count) const {
+        assert(count > 0);
+        int64_t lo = INT64_MAX, hi = INT64_MIN;
+        for (size_t i = 0; i < count; ++i) {
+            int64_t key = ((int64_t)pos[nodes[i]] << 32) | (uint32_t)nodes[i];
+            lo = min(lo, key);
+            hi = max(hi, key);
+        }
+        return get_lca((int)(uint32_t)lo, (int)(uint32_t)hi);
+    }
+
+    int lca_of_set(const vector<int>& nodes) const {
+        return lca_of_set(nodes.data(), nodes.size());
+    }
+
+#ifdef HLD_HAS_SPAN
+    int lca_of_set(span<const int> nodes) const {
+        return lca_of_set(nodes.data(), nodes.size());
+    }
+#endif
+
+    /**
+     * @brief Checks whether u is an ancestor of v (a node is its own ancestor).
+     *        Uses interval containment: pos[u] <= pos[v] < pos[u] + subtree_size[u].
+     *
+     * @note Time complexity: O(1).
+     */
+    bool is_ancestor(int u, int v) const {
+        return (unsigned)(pos[v] - pos[u]) < (unsigned)subtree_size[u];
+    }
+
+    /**
+     * @brief Answers is_ancestor for many pairs with a branch-free loop.
+     * @param pairs Flat array {ancestor0, node0, ancestor1, node1, ...}.
+     * @param count The number of pairs.
+     * @param results Output array; results[i] is 1 if the i-th pair is (ancestor, descendant), else 0.
+     *
+     * @note Time complexity: O(count).
+     */
+    void is_ancestor_batch(const int* pairs, size_t count, uint8_t* results) const {
+        for (size_t i = 0; i < count; ++i) {
+            int u = pairs[2 * i], v = pairs[2 * i + 1];
+            results[i] = (uint8_t)((unsigned)(pos[v] - pos[u]) < (unsigned)subtree_size[u]);
+        }
+    }
+
+    static constexpr int kDefaultBatchWidth = 8;
+    static constexpr int kMaxBatchWidth = 32;
+
+    /**
+     * @brief Sets how many queries the batch methods walk in lockstep (clamped to [1, kMaxBatchWidth]).
+     *        Wider groups hide more memory latency but keep more state live; see HLDAutoTuner.
+     */
+    void set_batch_width(int width) {
+        batch_width = max(1, min(width, kMaxBatchWidth));
+    }
+
+    int get_batch_width() const { return batch_width; }
+
+    // Read-only views of the decomposition, valid after build(), for indexes built on top of it.
+    int size() const { return N; }
+    int get_parent(int u) const { return parent[u]; }
+    int get_depth(int u) const { return depth[u]; }
+    int get_subtree_size(int u) const { return subtree_size[u]; }
+    int get_pos(int u) const { return pos[u]; }
+    int get_node_value(int u) const { return values[u]; }
+
+    /**
+     * @brief Counts heavy chains (nodes that head their own chain).
+     * @note Time complexity: O(N).
+     */
+    int num_chains() const {
+        int chains = 0;
+        for (int u = 0; u < N; ++u) {
+            chains += (head[u] == u);
+        }
+        return chains;
+    }
+
+    /**
+     * @brief Approximate heap bytes held by this object, including the adjacency and the segment tree.
+     */
+    size_t memory_bytes() const {
+        size_t bytes = sizeof(*this) + edge_buffers.capacity() * sizeof(vector<pair<int, int>>);
+        for (const vector<pair<int, int>>& buffer : edge_buffers) {
+            bytes += buffer.capacity() * sizeof(pair<int, int>);
+        }
+        for (const vector<int>* array : {&adj_offsets, &adj_targets, &values, &parent, &depth, &subtree_size, &heavy_child, &head, &pos}) {
+            bytes += array->capacity() * sizeof(int);
+        }
+        return bytes + seg_tree.memory_bytes();
+    }
+
+private:
     int N; // Total number of nodes in the tree
-    vector<vector<int>> adj; // Adjacency list for the tree
+    vector<vector<pair<int, int>>> edge_buffers; // Edges awaiting build(); buffer 0 receives add_edge
+    vector<int> adj_offsets; // CSR adjacency: neighbours of u are adj_targets[adj_offsets[u], adj_offsets[u+1])
+    vector<int> adj_targets;
     vector<int> values; // Stores original values at nodes
 
-    vector<int> parent;      // Stores the parent of each node in the DFS tree
-    vector<int> depth;       // Stores the depth of each node (distance from root)
-    vector<int> subtree_size; // Stores the size of the subtree rooted at each node
-    vector<int> heavy_child; // Stores the heavy child of a node, -1 if none
-    vector<int> head;        // Stores the head of the heavy path node u belongs to
-    vector<int> pos;         // Stores the position of node u in the flattened segment tree array
-    int cur_pos;                  // Current position counter for the segment tree array
+    vector<int> parent;      // Stores the parent of each node in the DFS tree
+    vector<int> depth;       // Stores the depth of each node (distance from root)
+    vector<int> subtree_size; // Stores the size of the subtree rooted at each node
+    vector<int> heavy_child; // Stores the heavy child of a node, -1 if none
+    vector<int> head;        // Stores the head of the heavy path node u belongs to
+    vector<int> pos;         // Stores the position of node u in the flattened segment tree array
+    int cur_pos;                  // Current position counter for the segment tree array
+
+    SegmentTree seg_tree; // Segment tree to store values on flattened heavy paths
+
+    int batch_width; // Queries walked in lockstep by walk_batch, at most kMaxBatchWidth
+
+    /**
+     * @brief Shared chain walk behind query_path_batch and get_lca_batch.
+     *        Active queries of a group are kept in a compacted index list; each round advances
+     *        every active query by one chain hop and retires those that reached a common chain.
+     *
+     * @param pairs Flat array of endpoints.
+     * @param count The number of queries.
+     * @param results Output array: path sums if with_sums, otherwise LCAs.
+     * @param with_sums Whether to accumulate segment tree sums along the way.
+     */
+    void walk_batch(const int* pairs, size_t count, int* results, bool with_sums) {
+        int us[kMaxBatchWidth], vs[kMaxBatchWidth], acc[kMaxBatchWidth];
+        int active_idx[kMaxBatchWidth];
+
+        for (size_t base = 0; base < count; base += batch_width) {
+            int group = (int)min((size_t)batch_width, count - base);
+            for (int i = 0; i < group; ++i) {
+                us[i] = pairs[2 * (base + i)];
+                vs[i] = pairs[2 * (base + i) + 1];
+                acc[i] = 0;
+                active_idx[i] = i;
+            }
+
+            int active = group;
+            while (active > 0) {
+                int still_active = 0;
+                for (int k = 0; k < active; ++k) {
+                    int i = active_idx[k];
+                    int u = us[i], v = vs[i];
+                    if (head[u] == head[v]) {
+                        if (depth[u] > depth[v]) {
+                            swap(u, v);
+                        }
+                        if (with_sums) {
+                            results[base + i] = acc[i] + seg_tree.query(pos[u], pos[v]);
+                        } else {
+                            results[base + i] = u;
+                        }
+                        continue;
+                    }
+                    if (depth[head[u]] < depth[head[v]]) {
+                        swap(u, v);
+                    }
+                    if (with_sums) {
+                        acc[i] += seg_tree.query(pos[head[u]], pos[u]);
+                    }
+                    u = parent[head[u]];
+                    HLD_COUNT_OP(chain_hops);
+                    HLD_PREFETCH(&head[u]);
+                    HLD_PREFETCH(&pos[u]);
+                    us[i] = u;
+                    vs[i] = v;
+                    active_idx[still_active++] = i;
+                }
+                active = still_active;
+            }
+        }
+    }
+
+    // Each worker clears a 2^16-entry radix count array per pass; with fewer edges than that per worker,
+    // clearing would cost more than sorting.
+    static constexpr size_t kMinEdgesPerThread = 1 << 16;
+    static constexpr int kRadixBits = 16;
+
+    /**
+     * @brief Merges the edge buffers into the CSR adjacency in parallel, then frees them.
+     *        Each worker turns its buffers into (node, neighbour) entries and stable-radix-sorts them by node, so
+     *        within a node they keep insertion order. Workers then own disjoint node ranges: they count the
+     *        degrees in their range across all buffers (a binary search finds each buffer's run), take their
+     *        offsets from a prefix sum over range totals, and copy the runs buffer by buffer. The adjacency order
+     *        is therefore buffer order, then insertion order, as with add_edge. Scratch memory is O(E) plus one
+     *        radix count array per worker, independent of N and of the number of buffers.
+     *
+     * @note Time complexity: O(E + N + buffers * workers * log E), spread over the workers.
+     */
+    void build_adjacency() {
+        const int num_buffers = (int)edge_buffers.size();
+        size_t total_edges = 0;
+        for (const auto& buffer : edge_buffers) total_edges += buffer.size();
+        int num_threads = (int)min<size_t>((size_t)max(1u, thread::hardware_concurrency()),
+                                           max<size_t>(1, total_edges / kMinEdgesPerThread));
+        // Each worker records its own span, so a trace shows one track per thread.
+        auto run_parallel = [num_threads](const auto& work) {
+            auto traced_work = [&work](int t) {
+                HLD_TRACE_SCOPE("build_adjacency.worker");
+                work(t);
+            };
+            vector<thread> workers;
+            for (int t = 1; t < num_threads; ++t) workers.emplace_back(traced_work, t);
+            traced_work(0);
+            for (thread& t : workers) t.join();
+        };
+
+        // entries[b]: buffer b as (node << 32 | neighbour), sorted by node.
+        vector<vector<uint64_t>> entries(num_buffers);
+        run_parallel([&](int t) {
+            for (int b = t; b < num_buffers; b += num_threads) {
+                entries[b].reserve(2 * edge_buffers[b].size());
+                for (const auto& e : edge_buffers[b]) {
+                    entries[b].push_back((uint64_t)e.first << 32 | (uint32_t)e.second);
+                    entries[b].push_back((uint64_t)e.second << 32 | (uint32_t)e.first);
+                }
+                vector<pair<int, int>>().swap(edge_buffers[b]);
+                sort_by_node(entries[b], N);
+            }
+        });
+
+        // run_start(b, u): index of the first entry of buffer b whose node is >= u.
+        auto run_start = [&](int b, int u) {
+            return (size_t)(lower_bound(entries[b].begin(), entries[b].end(), (uint64_t)u << 32) - entries[b].begin());
+        };
+        auto node_range = [&](int t) {
+            return make_pair((int)((int64_t)N * t / num_threads), (int)((int64_t)N * (t + 1) / num_threads));
+        };
+
+        // adj_offsets[u] first holds the degree of u, then its first slot, then (after the copy) its end.
+        adj_offsets.assign(N + 1, 0);
+        vector<int> range_total(num_threads + 1, 0);
+        run_parallel([&](int t) {
+            int lo = node_range(t).first, hi = node_range(t).second;
+            for (int b = 0; b < num_buffers; ++b) {
+                for (size_t k = run_start(b, lo); k < entries[b].size() && (int)(entries[b][k] >> 32) < hi; ++k) {
+                    ++adj_offsets[entries[b][k] >> 32];
+                }
+            }
+            int total = 0;
+            for (int u = lo; u < hi; ++u) total += adj_offsets[u];
+            range_total[t + 1] = total;
+        });
+        partial_sum(range_total.begin(), range_total.end(), range_total.begin());
+
+        adj_targets.resize(range_total[num_threads]);
+        run_parallel([&](int t) {
+            int lo = node_range(t).first, hi = node_range(t).second;
+            int offset = range_total[t];
+            for (int u = lo; u < hi; ++u) {
+                int degree = adj_offsets[u];
+                adj_offsets[u] = offset;
+                offset += degree;
+            }
+            for (int b = 0; b < num_buffers; ++b) {
+                for (size_t k = run_start(b, lo); k < entries[b].size() && (int)(entries[b][k] >> 32) < hi; ++k) {
+                    adj_targets[adj_offsets[entries[b][k] >> 32]++] = (int)(uint32_t)entries[b][k];
+                }
+            }
+        });
+        // Each adj_offsets[u] now ends node u, i.e. starts node u + 1; shift by one to get the starts.
+        adj_offsets.pop_back();
+        adj_offsets.insert(adj_offsets.begin(), 0);
+        vector<vector<pair<int, int>>>(1).swap(edge_buffers);
+    }
+
+    // Stable LSD radix sort of (node << 32 | neighbour) entries by node, kRadixBits of the node per pass.
+    static void sort_by_node(vector<uint64_t>& keys, int num_nodes) {
+        vector<uint64_t> scratch(keys.size());
+        vector<size_t> count((1 << kRadixBits) + 1);
+        const uint64_t digit_mask = (1 << kRadixBits) - 1;
+        for (int shift = 32; shift < 64; shift += kRadixBits) {
+            if (shift > 32 && ((uint64_t)(num_nodes - 1) >> (shift - 32)) == 0) break;
+            fill(count.begin(), count.end(), 0);
+            for (uint64_t key : keys) ++count[((key >> shift) & digit_mask) + 1];
+            partial_sum(count.begin(), count.end(), count.begin());
+            for (uint64_t key : keys) scratch[count[(key >> shift) & digit_mask]++] = key;
+            keys.swap(scratch);
+        }
+    }
+
+    /**
+     * @brief First DFS pass to calculate subtree sizes, depths, and parents,
+     *        and identify the heavy child for each node.
+     *        Uses an explicit stack so that deep trees (long paths) do not overflow the call stack;
+     *        children are scanned in adjacency order, so ties pick the same heavy child as a recursive DFS.
+     *
+     * @param root The root node of the tree.
+     * @return false if a node is reached twice or some node is never reached, so the edges are not a tree.
+     */
+    bool dfs1_size_depth_parent(int root) {
+        vector<int> order;
+        order.reserve(N);
+        vector<int> stack = {root};
+        parent[root] = -1;
+        depth[root] = 0;
+
+        while (!stack.empty()) {
+            int u = stack.back();
+            stack.pop_back();
+            order.push_back(u);
+            for (int k = adj_offsets[u]; k < adj_offsets[u + 1]; ++k) {
+                int v = adj_targets[k];
+                if (v == parent[u]) continue;
+                // Every parent starts at -1, so a set parent means a second route to v.
+                if (v == root || parent[v] != -1) return false;
+                parent[v] = u;
+                depth[v] = depth[u] + 1;
+                stack.push_back(v);
+            }
+        }
+
+        // Children appear after their parent in `order`, so a reverse scan sees complete subtrees.
+        for (int i = (int)order.size() - 1; i >= 0; --i) {
+            int u = order[i];
+            int max_c_subtree_size = 0;
+            for (int k = adj_offsets[u]; k < adj_offsets[u + 1]; ++k) {
+                int v = adj_targets[k];
+                if (v == parent[u]) continue;
+                subtree_size[u] += subtree_size[v];
+                if (subtree_size[v] > max_c_subtree_size) {
+                    max_c_subtree_size = subtree_size[v];
+                    heavy_child[u] = v;
+                }
+            }
+        }
+        return (int)order.size() == N;
+    }
+
+    /**
+     * @brief Second DFS pass to perform Heavy-Light Decomposition.
+     *        Assigns chain heads and positions in the flattened array in heavy-first preorder.
+     *        Light children are pushed in reverse adjacency order and the heavy child last, so the
+     *        heavy child is visited right after its parent and light children keep adjacency order.
+     *
+     * @param root The root node of the tree.
+     */
+    void dfs2_hld(int root) {
+        vector<int> stack = {root};
+        head[root] = root;
+
+        while (!stack.empty()) {
+            int u = stack.back();
+            stack.pop_back();
+            pos[u] = cur_pos++;
+
+            for (int k = adj_offsets[u + 1] - 1; k >= adj_offsets[u]; --k) {
+                int v = adj_targets[k];
+                if (v == parent[u] || v == heavy_child[u]) continue;
+                head[v] = v;
+                stack.push_back(v);
+            }
+            if (heavy_child[u] != -1) {
+                head[heavy_child[u]] = head[u];
+                stack.push_back(heavy_child[u]);
+            }
+        }
+    }
+};
+
+// --- Path aggregates over any commutative monoid ---
+template <typename Monoid>
+class PathMonoidIndex {
+public:
+    using value_type = typename Monoid::value_type;
+
+    /**
+     * @brief Builds a segment tree of per-node monoid values laid out in the HLD's `pos` order.
+     * @param hld A built HLD describing the tree topology; it must outlive this index.
+     * @param node_values node_values[u] is the monoid value of node u.
+     *
+     * @note Time complexity: O(N) combines.
+     */
+    PathMonoidIndex(const HLD& hld, const vector<value_type>& node_values) : hld(hld), tree(hld.size()) {
+        vector<value_type> at_pos(hld.size());
+        for (int u = 0; u < hld.size(); ++u) {
+            at_pos[hld.get_pos(u)] = node_values[u];
+        }
+        tree.build_from_mapped_values(at_pos);
+    }
+
+    /**
+     * @brief Builds from the HLD's current node values, lifted by Monoid::single(int).
+     * @note Time complexity: O(N) combines.
+     */
+    explicit PathMonoidIndex(const HLD& hld) : hld(hld), tree(hld.size()) {
+        vector<value_type> at_pos(hld.size());
+        for (int u = 0; u < hld.size(); ++u) {
+            at_pos[hld.get_pos(u)] = Monoid::single(hld.get_node_value(u));
+        }
+        tree.build_from_mapped_values(at_pos);
+    }
+
+    /**
+     * @brief Replaces the monoid value of node u.
+     * @note Time complexity: O(log N) combines.
+     */
+    void set_node(int u, const value_type& x) {
+        tree.update(hld.get_pos(u), x);
+    }
+
+    /**
+     * @brief Sets node u to Monoid::single(value).
+     * @note Time complexity: O(log N) combines.
+     */
+    void update_node_value(int u, int value) {
+        set_node(u, Monoid::single(value));
+    }
+
+    /**
+     * @brief Combines the values of every node on the path between u and v. Segments are combined in chain-walk
+     *        order, so the monoid must be commutative.
+     * @note Time complexity: O(log^2 N) combines.
+     */
+    value_type query_path(int u, int v) const {
+        value_type acc = Monoid::identity();
+        hld.for_each_path_segment(u, v, [&](int l, int r) {
+            acc = Monoid::combine(acc, tree.query(l, r));
+        });
+        return acc;
+    }
+
+private:
+    const HLD& hld;
+    BasicSegmentTree<Monoid> tree;
+};
+
+// --- Dynamic weighted diameter over the Euler tour of the decomposition ---
+class DynamicDiameterIndex {
+public:
+    /**
+     * @brief Builds the index over a built HLD.
+     *        The Euler tour visits children in the HLD's heavy-first `pos` order, so the subtree of v is
+     *        the contiguous tour interval [first[v], last[v]] and a weight change becomes one range-add.
+     *
+     * @param hld A built HLD describing the tree topology.
+     * @param edge_weight_to_parent edge_weight_to_parent[v] is the weight of edge (parent(v), v);
+     *        the root's entry is ignored. Weights must be non-negative.
+     *
+     * @note Time complexity: O(N). Space complexity: O(N).
+     */
+    DynamicDiameterIndex(const HLD& hld, const vector<long long>& edge_weight_to_parent)
+        : hld(hld), weight(edge_weight_to_parent), first(hld.size()), last(hld.size()) {
+        int n = hld.size();
+        vector<int> node_at_pos(n);
+        for (int u = 0; u < n; ++u) {
+            node_at_pos[hld.get_pos(u)] = u;
+        }
+
+        vector<long long> root_distance(n, 0);
+        vector<int> stack;
+        euler.reserve(2 * n - 1);
+        for (int k = 0; k < n; ++k) {
+            int u = node_at_pos[k];
+            int p = hld.get_parent(u);
+            if (p != -1) {
+                assert(weight[u] >= 0);
+                root_distance[u] = root_distance[p] + weight[u];
+            }
+            // In preorder the parent of u is on the stack; every node popped returns the tour to its parent.
+            while (!stack.empty() && stack.back() != p) {
+                stack.pop_back();
+                append_to_tour(stack.back());
+            }
+            first[u] = (int)euler.size();
+            append_to_tour(u);
+            stack.push_back(u);
+        }
+        while (stack.size() > 1) {
+            stack.pop_back();
+            append_to_tour(stack.back());
+        }
+
+        m = (int)euler.size();
+        tree.resize(4 * m);
+        lazy.assign(4 * m, 0);
+        build(root_distance, 0, 0, m - 1);
+    }
+
+    /**
+     * @brief Changes the weight of edge (parent(v), v) by range-adding the difference to v's subtree.
+     * @param v A non-root node.
+     * @param new_weight The new non-negative weight.
+     *
+     * @note Time complexity: O(log N).
+     */
+    void update_edge_weight(int v, long long new_weight) {
+        assert(hld.get_parent(v) != -1 && new_weight >= 0);
+        long long delta = new_weight - weight[v];
+        weight[v] = new_weight;
+        if (delta != 0) {
+            range_add(0, 0, m - 1, first[v], last[v], delta);
+        }
+    }
+
+    /**
+     * @brief Returns the current weighted diameter.
+     * @note Time complexity: O(1).
+     */
+    long long diameter() const {
+        return tree[0].lmr;
+    }
+
+    /**
+     * @brief Returns two nodes whose distance equals diameter().
+     * @note Time complexity: O(1).
+     */
+    pair<int, int> diameter_endpoints() const {
+        return {euler[tree[0].lmr_a], euler[tree[0].lmr_c]};
+    }
+
+    /**
+     * @brief Finds a node at maximum weighted distance from u.
+     * @param u The source node.
+     * @return {distance, node}.
+     *
+     * @note Time complexity: O(log N).
+     */
+    pair<long long, int> farthest_from(int u) {
+        int i = first[u];
+        // Targets after u in the tour: max over i <= b <= c of d[c] - 2 d[b]; before u: max over a <= b <= i of d[a] - 2 d[b].
+        Node right = query(0, 0, m - 1, i, m - 1);
+        Node left = query(0, 0, m - 1, 0, i);
+        long long du = point_distance(0, 0, m - 1, i);
+        if (right.mr >= left.lm) {
+            return {du + right.mr, euler[right.mr_c]};
+        }
+        return {du + left.lm, euler[left.lm_a]};
+    }
+
+private:
+    // d = weighted root distance at a tour index. For indices a <= b <= c within the node's range:
+    // lm = max d[a] - 2 d[b], mr = max d[c] - 2 d[b], lmr = max d[a] - 2 d[b] + d[c].
+    struct Node {
+        long long max_d, min_d, lm, mr, lmr;
+        int max_i, lm_a, mr_c, lmr_a, lmr_c;
+    };
+
+    const HLD& hld;
+    vector<long long> weight; // Current weight of the edge to each node's parent
+    vector<int> euler;        // Euler tour of nodes (size 2N-1)
+    vector<int> first, last;  // First and last tour index of each node
+    int m;                    // Tour length
+    vector<Node> tree;
+    vector<long long> lazy;   // Pending range-add per segment tree node
+
+    void append_to_tour(int u) {
+        last[u] = (int)euler.size();
+        euler.push_back(u);
+    }
+
+    static Node make_leaf(long long d, int i) {
+        return {d, d, -d, -d, 0, i, i, i, i, i};
+    }
+
+    static Node combine(const Node& l, const Node& r) {
+        Node res;
+        res.max_d = max(l.max_d, r.max_d);
+        res.max_i = (l.max_d >= r.max_d) ? l.max_i : r.max_i;
+        res.min_d = min(l.min_d, r.min_d);
+
+        res.lm = l.lm, res.lm_a = l.lm_a;
+        if (r.lm > res.lm) res.lm = r.lm, res.lm_a = r.lm_a;
+        if (l.max_d - 2 * r.min_d > res.lm) res.lm = l.max_d - 2 * r.min_d, res.lm_a = l.max_i;
+
+        res.mr = l.mr, res.mr_c = l.mr_c;
+        if (r.mr > res.mr) res.mr = r.mr, res.mr_c = r.mr_c;
+        if (r.max_d - 2 * l.min_d > res.mr) res.mr = r.max_d - 2 * l.min_d, res.mr_c = r.max_i;
+
+        res.lmr = l.lmr, res.lmr_a = l.lmr_a, res.lmr_c = l.lmr_c;
+        if (r.lmr > res.lmr) res.lmr = r.lmr, res.lmr_a = r.lmr_a, res.lmr_c = r.lmr_c;
+        if (l.lm + r.max_d > res.lmr) res.lmr = l.lm + r.max_d, res.lmr_a = l.lm_a, res.lmr_c = r.max_i;
+        if (l.max_d + r.mr > res.lmr) res.lmr = l.max_d + r.mr, res.lmr_a = l.max_i, res.lmr_c = r.mr_c;
+        return res;
+    }
+
+    void apply(int node, long long delta) {
+        Node& t = tree[node];
+        t.max_d += delta;
+        t.min_d += delta;
+        t.lm -= delta;
+        t.mr -= delta;
+        lazy[node] += delta;
+    }
+
+    void push_down(int node) {
+        if (lazy[node] != 0) {
+            apply(2 * node + 1, lazy[node]);
+            apply(2 * node + 2, lazy[node]);
+            lazy[node] = 0;
+        }
+    }
+
+    void build(const vector<long long>& root_distance, int node, int start, int end) {
+        if (start == end) {
+            tree[node] = make_leaf(root_distance[euler[start]], start);
+            return;
+        }
+        int mid = (start + end) / 2;
+        build(root_distance, 2 * node + 1, start, mid);
+        build(root_distance, 2 * node + 2, mid + 1, end);
+        tree[node] = combine(tree[2 * node + 1], tree[2 * node + 2]);
+    }
+
+    void range_add(int node, int start, int end, int l, int r, long long delta) {
+        if (r < start || end < l) return;
+        if (l <= start && end <= r) {
+            apply(node, delta);
+            return;
+        }
+        push_down(node);
+        int mid = (start + end) / 2;
+        range_add(2 * node + 1, start, mid, l, r, delta);
+        range_add(2 * node + 2, mid + 1, end, l, r, delta);
+        tree[node] = combine(tree[2 * node + 1], tree[2 * node + 2]);
+    }
+
+    Node query(int node, int start, int end, int l, int r) {
+        if (l <= start && end <= r) {
+            return tree[node];
+        }
+        push_down(node);
+        int mid = (start + end) / 2;
+        if (r <= mid) return query(2 * node + 1, start, mid, l, r);
+        if (l > mid) return query(2 * node + 2, mid + 1, end, l, r);
+        return combine(query(2 * node + 1, start, mid, l, r), query(2 * node + 2, mid + 1, end, l, r));
+    }
+
+    long long point_distance(int node, int start, int end, int idx) {
+        if (start == end) {
+            return tree[node].max_d;
+        }
+        push_down(node);
+        int mid = (start + end) / 2;
+        return (idx <= mid) ? point_distance(2 * node + 1, start, mid, idx)
+                            : point_distance(2 * node + 2, mid + 1, end, idx);
+    }
+};
+
+// --- Time-windowed path aggregates ---
+class TimeWindowedHLD {
+public:
+    /**
+     * @brief Wraps a built HLD whose node values are counts of events seen in the last `window` time units.
+     *        Each event adds to its node's value and is subtracted again once it expires. The node values
+     *        present at construction act as a permanent baseline.
+     *
+     * @param hld A built HLD that this object updates; it must outlive this object.
+     * @param window An event at time t contributes to queries at time now while t > now - window.
+     */
+    TimeWindowedHLD(HLD& hld, long long window)
+        : hld(hld), window(window), latest_time(numeric_limits<long long>::min()), expired_delta(hld.size(), 0) {
+    }
+
+    /**
+     * @brief Records `count` events on node u at `timestamp`.
+     *        Timestamps must be non-decreasing across add_event and query_path calls.
+     *
+     * @note Time complexity: O(log N) plus amortised expiry.
+     */
+    void add_event(int u, int count, long long timestamp) {
+        expire(timestamp);
+        events.push_back({timestamp, u, count});
+        hld.update_node_value(u, hld.get_node_value(u) + count);
+    }
+
+    /**
+     * @brief Sums the unexpired contributions (plus baseline values) on the path between u and v at time now.
+     *
+     * @note Time complexity: O(log^2 N) plus amortised expiry; history is never rescanned.
+     */
+    int query_path(int u, int v, long long now) {
+        expire(now);
+        return hld.query_path(u, v);
+    }
+
+    /**
+     * @brief Retires every event with timestamp <= now - window.
+     *        Expired events are popped from the time-ordered queue and their counts summed per node first,
+     *        so a burst of expiries costs one segment tree update per distinct node.
+     *
+     * @note Time complexity: amortised O(log N) per event over the object's lifetime.
+     */
+    void expire(long long now) {
+        assert(now >= latest_time);
+        latest_time = now;
+        while (!events.empty() && events.front().timestamp <= now - window) {
+            const Event& e = events.front();
+            if (expired_delta[e.node] == 0) {
+                touched_nodes.push_back(e.node);
+            }
+            expired_delta[e.node] += e.count;
+            events.pop_front();
+        }
+        for (int u : touched_nodes) {
+            if (expired_delta[u] != 0) {
+                hld.update_node_value(u, hld.get_node_value(u) - expired_delta[u]);
+                expired_delta[u] = 0;
+            }
+        }
+        touched_nodes.clear();
+    }
+
+    size_t live_events() const {
+        return events.size();
+    }
+
+private:
+    struct Event {
+        long long timestamp;
+        int node;
+        int count;
+    };
+
+    HLD& hld;
+    long long window;
+    long long latest_time;     // Largest timestamp seen; time must not go backwards
+    deque<Event> events;       // Unexpired events in timestamp order
+    vector<int> expired_delta; // Per-node sum of counts expiring in the current batch (zero between batches)
+    vector<int> touched_nodes; // Nodes with a non-zero expired_delta in the current batch
+};
+
+// --- Label-set path queries over 64-bit tag masks ---
+class PathLabelIndex {
+public:
+    /**
+     * @brief Builds OR and AND segment trees of per-node tag masks in the HLD's `pos` order.
+     * @param hld A built HLD describing the tree topology; it must outlive this index.
+     * @param node_labels node_labels[u] has bit t set iff node u carries tag t (t < 64).
+     *
+     * @note Time complexity: O(N). Space complexity: O(N).
+     */
+    PathLabelIndex(const HLD& hld, const vector<uint64_t>& node_labels)
+        : any_index(hld, node_labels), all_index(hld, node_labels) {}
+
+    /**
+     * @brief Replaces the tag mask of node u.
+     * @note Time complexity: O(log N).
+     */
+    void set_node_labels(int u, uint64_t labels) {
+        any_index.set_node(u, labels);
+        all_index.set_node(u, labels);
+    }
+
+    /**
+     * @brief Returns the tags that appear on at least one node of the path between u and v.
+     * @note Time complexity: O(log^2 N).
+     */
+    uint64_t path_labels(int u, int v) const {
+        return any_index.query_path(u, v);
+    }
+
+    /**
+     * @brief Returns the tags carried by every node of the path between u and v.
+     * @note Time complexity: O(log^2 N).
+     */
+    uint64_t path_common_labels(int u, int v) const {
+        return all_index.query_path(u, v);
+    }
+
+    /**
+     * @brief Checks whether tag `label` (0 <= label < 64) appears on the path between u and v.
+     * @note Time complexity: O(log^2 N).
+     */
+    bool path_has_label(int u, int v, int label) const {
+        assert(0 <= label && label < 64);
+        return (path_labels(u, v) >> label) & 1;
+    }
+
+    /**
+     * @brief Answers path_labels for many paths; test membership of tag t with (results[i] >> t) & 1.
+     * @param pairs Flat array of endpoints {u0, v0, u1, v1, ...}.
+     * @param count The number of paths.
+     * @param results Output array with room for count masks.
+     *
+     * @note Time complexity: O(count * log^2 N).
+     */
+    void path_labels_batch(const int* pairs, size_t count, uint64_t* results) const {
+        for (size_t i = 0; i < count; ++i) {
+            results[i] = path_labels(pairs[2 * i], pairs[2 * i + 1]);
+        }
+    }
+
+private:
+    PathMonoidIndex<BitOrMonoid> any_index;  // Union of tags per `pos` range
+    PathMonoidIndex<BitAndMonoid> all_index; // Intersection of tags per `pos` range
+};
+
+// --- Skew-binary jump pointers for online leaf appends ---
+class OnlineAncestorIndex {
+public:
+    /**
+     * @brief Seeds the index with the nodes of a built HLD; new leaves are then numbered from hld.size() on.
+     *        Each node stores only parent, depth and one jump pointer, chosen so that jump lengths follow
+     *        the skew-binary decomposition of the depth. This gives O(log n) ancestor searches while every
+     *        leaf is appended in O(1), independent of the heavy-path decomposition.
+     *
+     * @note Time complexity: O(N).
+     */
+    explicit OnlineAncestorIndex(const HLD& hld)
+        : parent(hld.size()), depth(hld.size()), jump(hld.size()) {
+        vector<int> order(hld.size());
+        for (int u = 0; u < hld.size(); ++u) {
+            order[hld.get_pos(u)] = u;
+        }
+        // Parents precede children in `pos` order.
+        for (int u : order) {
+            attach(u, hld.get_parent(u));
+        }
+    }
+
+    /**
+     * @brief Appends a new leaf below node p.
+     * @return The id of the new node.
+     *
+     * @note Time complexity: O(1) amortised.
+     */
+    int add_leaf(int p) {
+        int v = size();
+        parent.push_back(0);
+        depth.push_back(0);
+        jump.push_back(0);
+        attach(v, p);
+        return v;
+    }
+
+    int size() const { return (int)parent.size(); }
+    int get_depth(int u) const { return depth[u]; }
+    int get_parent(int u) const { return parent[u]; }
+
+    /**
+     * @brief Returns the ancestor of u at depth d (d <= depth of u).
+     * @note Time complexity: O(log n).
+     */
+    int ancestor_at_depth(int u, int d) const {
+        while (depth[u] > d) {
+            u = (depth[jump[u]] < d) ? parent[u] : jump[u];
+        }
+        return u;
+    }
+
+    /**
+     * @brief Returns the k-th ancestor of u (k = 0 is u itself), or -1 if u has fewer than k ancestors.
+     * @note Time complexity: O(log n).
+     */
+    int kth_ancestor(int u, int k) const {
+        if (k > depth[u]) return -1;
+        return ancestor_at_depth(u, depth[u] - k);
+    }
+
+    /**
+     * @brief Finds the LCA of two nodes. Nodes at equal depth share their jump structure, so the two
+     *        climbs stay in lockstep and take a jump whenever it does not overshoot the LCA.
+     * @note Time complexity: O(log n).
+     */
+    int get_lca(int u, int v) const {
+        if (depth[u] > depth[v]) u = ancestor_at_depth(u, depth[v]);
+        else v = ancestor_at_depth(v, depth[u]);
+        while (u != v) {
+            if (jump[u] != jump[v]) {
+                u = jump[u];
+                v = jump[v];
+            } else {
+                u = parent[u];
+                v = parent[v];
+            }
+        }
+        return u;
+    }
+
+private:
+    vector<int> parent; // parent[root] == root
+    vector<int> depth;
+    vector<int> jump;   // Ancestor reached by the node's skew-binary jump
+
+    void attach(int v, int p) {
+        if (p == -1) {
+            parent[v] = jump[v] = v;
+            depth[v] = 0;
+            return;
+        }
+        parent[v] = p;
+        depth[v] = depth[p] + 1;
+        // Two equal-length jumps from p merge into one jump of twice the length plus one.
+        int j = jump[p];
+        jump[v] = (depth[p] - depth[j] == depth[j] - depth[jump[j]]) ? jump[j] : p;
+    }
+};
+
+// --- Bit vector with constant-time rank and sampled select ---
+class RankBitVector {
+public:
+    RankBitVector() : num_bits(0) {}
+
+    explicit RankBitVector(size_t num_bits) : num_bits(num_bits), words((num_bits + 63) / 64, 0) {}
+
+    void set(size_t i) {
+        words[i >> 6] |= 1ULL << (i & 63);
+    }
+
+    bool get(size_t i) const {
+        return (words[i >> 6] >> (i & 63)) & 1;
+    }
+
+    /**
+     * @brief Prepares rank support; call once after the last set().
+     *        Stores one cumulative count per 64-bit word (half a bit of overhead per bit).
+     */
+    void build_rank() {
+        word_rank.assign(words.size() + 1, 0);
+        for (size_t w = 0; w < words.size(); ++w) {
+            word_rank[w + 1] = word_rank[w] + HLD_POPCOUNT64(words[w]);
+        }
+    }
+
+    // Number of set bits in [0, i).
+    size_t rank1(size_t i) const {
+        size_t r = word_rank[i >> 6];
+        if (i & 63) r += HLD_POPCOUNT64(words[i >> 6] & ((1ULL << (i & 63)) - 1));
+        return r;
+    }
+
+    size_t rank0(size_t i) const {
+        return i - rank1(i);
+    }
+
+    /**
+     * @brief Prepares select support; call once after build_rank(). Samples the word holding every
+     *        kSelectSample-th set bit (one 32-bit entry per kSelectSample ones).
+     */
+    void build_select() {
+        select_sample.clear();
+        if (words.empty()) return; // No bits, so no k is valid for select1
+        for (size_t w = 0; w < words.size(); ++w) {
+            while ((size_t)select_sample.size() * kSelectSample < word_rank[w + 1]) {
+                select_sample.push_back((uint32_t)w);
+            }
+        }
+        select_sample.push_back((uint32_t)(words.size() - 1));
+    }
+
+    /**
+     * @brief Position of the k-th set bit (0-indexed); k must be below rank1(size()).
+     * @note Time complexity: O(log of the words between two samples + 64).
+     */
+    size_t select1(size_t k) const {
+        size_t lo = select_sample[k / kSelectSample], hi = select_sample[k / kSelectSample + 1];
+        // The word holding the bit is the last word w in [lo, hi] with word_rank[w] <= k.
+        while (lo < hi) {
+            size_t mid = (lo + hi + 1) / 2;
+            if (word_rank[mid] <= k) lo = mid; else hi = mid - 1;
+        }
+        uint64_t x = words[lo];
+        for (size_t r = k - word_rank[lo]; r > 0; --r) x &= x - 1;
+        return lo * 64 + HLD_CTZ64(x);
+    }
+
+    size_t size() const { return num_bits; }
+
+    size_t memory_bytes() const {
+        return words.capacity() * sizeof(uint64_t) + (word_rank.capacity() + select_sample.capacity()) * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr size_t kSelectSample = 512;
+
+    size_t num_bits;
+    vector<uint64_t> words;
+    vector<uint32_t> word_rank; // word_rank[w] = set bits in words [0, w)
+    vector<uint32_t> select_sample; // select_sample[s] = word holding set bit s * kSelectSample
+};
+
+// --- Subtree order statistics via a wavelet matrix over `pos` order ---
+class SubtreeOrderStatistics {
+public:
+    /**
+     * @brief Builds a wavelet matrix over the node values laid out in the HLD's `pos` order.
+     *        Values are rank-compressed to [0, σ), σ = number of distinct values, so the matrix has
+     *        ceil(log2 σ) levels. Since every subtree is the `pos` interval [pos[u], pos[u] + subtree_size[u]),
+     *        subtree queries become range order statistics. Both queries descend the levels with rank alone, so
+     *        the level bit vectors never build their select samples. The index is static: rebuild after updates.
+     *
+     * @note Time complexity: O(N log σ). Space complexity: N ceil(log2 σ) bits plus rank directories.
+     */
+    explicit SubtreeOrderStatistics(const HLD& hld) : hld(hld), n(hld.size()) {
+        vector<int> values_at_pos(n);
+        for (int u = 0; u < n; ++u) {
+            values_at_pos[hld.get_pos(u)] = hld.get_node_value(u);
+        }
+        sorted_values = values_at_pos;
+        sort(sorted_values.begin(), sorted_values.end());
+        sorted_values.erase(unique(sorted_values.begin(), sorted_values.end()), sorted_values.end());
+
+        levels = 1;
+        while ((1ULL << levels) < sorted_values.size()) ++levels;
+
+        vector<uint32_t> cur(n), next(n);
+        for (int i = 0; i < n; ++i) {
+            cur[i] = (uint32_t)(lower_bound(sorted_values.begin(), sorted_values.end(), values_at_pos[i]) -
+                                sorted_values.begin());
+        }
+
+        bits.resize(levels);
+        zeros.resize(levels);
+        for (int level = 0; level < levels; ++level) {
+            int shift = levels - 1 - level;
+            bits[level] = RankBitVector(n);
+            size_t zero_count = 0;
+            for (int i = 0; i < n; ++i) {
+                if ((cur[i] >> shift) & 1) bits[level].set(i);
+                else ++zero_count;
+            }
+            bits[level].build_rank();
+            zeros[level] = zero_count;
+
+            // Stable partition: values with a 0 bit first, then those with a 1 bit.
+            size_t z = 0, o = zero_count;
+            for (int i = 0; i < n; ++i) {
+                if ((cur[i] >> shift) & 1) next[o++] = cur[i];
+                else next[z++] = cur[i];
+            }
+            cur.swap(next);
+        }
+    }
+
+    /**
+     * @brief Returns the k-th smallest value (k = 0 is the minimum) in the subtree of u.
+     * @param k 0 <= k < subtree size of u.
+     *
+     * @note Time complexity: O(log σ).
+     */
+    int subtree_kth(int u, int k) const {
+        assert(0 <= k && k < hld.get_subtree_size(u));
+        size_t l = hld.get_pos(u), r = l + hld.get_subtree_size(u);
+        uint32_t rank = 0;
+        for (int level = 0; level < levels; ++level) {
+            size_t zl = bits[level].rank0(l), zr = bits[level].rank0(r);
+            if ((size_t)k < zr - zl) {
+                l = zl;
+                r = zr;
+            } else {
+                k -= (int)(zr - zl);
+                l = zeros[level] + (l - zl);
+                r = zeros[level] + (r - zr);
+                rank |= 1u << (levels - 1 - level);
+            }
+        }
+        return sorted_values[rank];
+    }
+
+    /**
+     * @brief Counts the values <= x in the subtree of u.
+     * @note Time complexity: O(log σ) after one binary search over the distinct values.
+     */
+    int subtree_count_le(int u, int x) const {
+        size_t l = hld.get_pos(u), r = l + hld.get_subtree_size(u);
+        size_t bound = upper_bound(sorted_values.begin(), sorted_values.end(), x) - sorted_values.begin();
+        if (bound >= sorted_values.size()) return (int)(r - l);
+
+        // Count compressed values < bound.
+        size_t count = 0;
+        for (int level = 0; level < levels; ++level) {
+            size_t zl = bits[level].rank0(l), zr = bits[level].rank0(r);
+            if ((bound >> (levels - 1 - level)) & 1) {
+                count += zr - zl;
+                l = zeros[level] + (l - zl);
+                r = zeros[level] + (r - zr);
+            } else {
+                l = zl;
+                r = zr;
+            }
+        }
+        return (int)count;
+    }
+
+private:
+    const HLD& hld;
+    int n;
+    int levels;                 // ceil(log2 σ), at least 1
+    vector<int> sorted_values;  // Distinct values; compressed value c stands for sorted_values[c]
+    vector<RankBitVector> bits; // bits[level][i]: bit (levels-1-level) of the i-th value at that level
+    vector<size_t> zeros;       // Number of 0 bits per level
+};
+
+// --- Decomposition shared across isomorphic subtrees ---
+class SharedSubtreeDecomposition {
+public:
+    /**
+     * @brief Builds a heavy-light decomposition that stores the metadata of repeated subtree shapes once.
+     *        Rooted subtrees are hash-consed bottom-up: a node's shape is the interned multiset of its
+     *        children's shapes. Children are laid out by (size desc, shape id), so every instance of a shape
+     *        gets the same heavy-first layout over a contiguous `pos` interval. Maximal repeated subtrees of at
+     *        least kMinSharedSize nodes are stored as (start, template, root depth, root parent, root head);
+     *        only the remaining nodes keep explicit per-node metadata. Nodes are addressed by position;
+     *        position_of translates caller ids.
+     * @param parent_of The parent of every node, -1 for the root only.
+     * @param values The initial node values.
+     *
+     * @note Time complexity: O(N log N) expected. Resident space: 8 bytes per node (values and id mapping)
+     *       plus metadata for unique nodes, distinct templates and instances.
+     */
+    SharedSubtreeDecomposition(const vector<int>& parent_of, const vector<int>& values)
+        : n((int)parent_of.size()), node_pos(n), fenwick(n + 1, 0) {
+        HLD_TRACE_SCOPE("SharedSubtreeDecomposition::build");
+        // Children in CSR form and a BFS order (parents before children).
+        vector<int> child_start(n + 1, 0), children(max(n - 1, 0));
+        int root = -1;
+        for (int u = 0; u < n; ++u) {
+            if (parent_of[u] == -1) root = u;
+            else ++child_start[parent_of[u] + 1];
+        }
+        assert(root != -1);
+        for (int u = 0; u < n; ++u) child_start[u + 1] += child_start[u];
+        vector<int> fill_at(child_start.begin(), child_start.end() - 1);
+        for (int u = 0; u < n; ++u) {
+            if (parent_of[u] != -1) children[fill_at[parent_of[u]]++] = u;
+        }
+        vector<int> bfs = {root};
+        bfs.reserve(n);
+        for (size_t i = 0; i < bfs.size(); ++i) {
+            for (int c = child_start[bfs[i]]; c < child_start[bfs[i] + 1]; ++c) bfs.push_back(children[c]);
+        }
+
+        // Hash-cons shapes bottom-up; sort each child list into the canonical layout order on the way.
+        vector<int> shape(n), size(n, 1);
+        vector<int> shape_size, shape_count;
+        unordered_map<vector<int>, int, SignatureHash> shape_ids;
+        vector<int> signature;
+        for (int i = n - 1; i >= 0; --i) {
+            int u = bfs[i];
+            int* first_child = children.data() + child_start[u];
+            int* last_child = children.data() + child_start[u + 1];
+            sort(first_child, last_child, [&](int a, int b) {
+                return size[a] != size[b] ? size[a] > size[b] : shape[a] < shape[b];
+            });
+            signature.clear();
+            for (int* c = first_child; c != last_child; ++c) {
+                signature.push_back(shape[*c]);
+                size[u] += size[*c];
+            }
+            auto inserted = shape_ids.emplace(signature, (int)shape_size.size());
+            if (inserted.second) {
+                shape_size.push_back(size[u]);
+                shape_count.push_back(0);
+            }
+            shape[u] = inserted.first->second;
+            ++shape_count[shape[u]];
+        }
+        num_distinct_shapes = (int)shape_size.size();
+
+        // Heavy-first preorder over the canonical child order; the first child is the heavy one.
+        vector<int> node_at(n), depth(n), head(n);
+        vector<int> stack = {root};
+        depth[root] = 0;
+        head[root] = root;
+        for (int next_pos = 0; !stack.empty(); ++next_pos) {
+            int u = stack.back();
+            stack.pop_back();
+            node_pos[u] = next_pos;
+            node_at[next_pos] = u;
+            for (int c = child_start[u + 1] - 1; c >= child_start[u]; --c) {
+                int v = children[c];
+                depth[v] = depth[u] + 1;
+                head[v] = (c == child_start[u]) ? head[u] : v;
+                stack.push_back(v);
+            }
+        }
+
+        // Maximal repeated subtrees become instances of a shared template.
+        vector<int> template_of_shape(num_distinct_shapes, -1);
+        unique_bits = RankBitVector(n);
+        for (int p = 0; p < n;) {
+            int u = node_at[p];
+            bool shared = shape_count[shape[u]] >= 2 && size[u] >= kMinSharedSize;
+            if (!shared) {
+                unique_bits.set(p);
+                unique_parent.push_back(parent_of[u] == -1 ? -1 : node_pos[parent_of[u]]);
+                unique_depth.push_back(depth[u]);
+                unique_head.push_back(node_pos[head[u]]);
+                unique_size.push_back(size[u]);
+                ++p;
+                continue;
+            }
+
+            int& t = template_of_shape[shape[u]];
+            if (t == -1) {
+                t = (int)template_start.size();
+                template_start.push_back((int)template_parent.size());
+                for (int i = 0; i < size[u]; ++i) {
+                    int w = node_at[p + i];
+                    template_parent.push_back(i == 0 ? -1 : node_pos[parent_of[w]] - p);
+                    template_depth.push_back(depth[w] - depth[u]);
+                    // Nodes on the instance root's chain take the root's head, which differs per instance.
+                    template_head.push_back(head[w] == head[u] ? -1 : node_pos[head[w]] - p);
+                    template_size.push_back(size[w]);
+                }
+            }
+            instance_start.push_back(p);
+            instances.push_back({t, depth[u], parent_of[u] == -1 ? -1 : node_pos[parent_of[u]], node_pos[head[u]]});
+            p += size[u];
+        }
+        unique_bits.build_rank();
+
+        for (int u = 0; u < n; ++u) {
+            add(node_pos[u], values[u]);
+        }
+    }
+
+    static constexpr int kMinSharedSize = 8; // Smaller repeats cost more as instances than as explicit nodes
+
+    int size() const { return n; }
+    int position_of(int u) const { return node_pos[u]; }
+    int num_shapes() const { return num_distinct_shapes; }
+    int num_templates() const { return (int)template_start.size(); }
+    int num_instances() const { return (int)instances.size(); }
+
+    int get_parent(int p) const { return info(p).parent; }
+    int get_depth(int p) const { return info(p).depth; }
+    int get_subtree_size(int p) const { return info(p).size; }
+
+    /**
+     * @brief Sets the value at position p.
+     * @note Time complexity: O(log N).
+     */
+    void update_value(int p, int new_value) {
+        add(p, new_value - range_sum(p, p));
+    }
+
+    /**
+     * @brief Sums the values on the path between positions p and q.
+     * @note Time complexity: O(log N (log N + log I)), I = number of instances.
+     */
+    int query_path(int p, int q) const {
+        int result = 0;
+        NodeInfo a = info(p), b = info(q);
+        while (a.head != b.head) {
+            NodeInfo head_a = info(a.head), head_b = info(b.head);
+            if (head_a.depth < head_b.depth) {
+                swap(p, q);
+                swap(a, b);
+                swap(head_a, head_b);
+            }
+            result += range_sum(a.head, p);
+            p = head_a.parent;
+            a = info(p);
+        }
+        return result + range_sum(min(p, q), max(p, q));
+    }
+
+    /**
+     * @brief Finds the LCA of positions p and q, returned as a position.
+     * @note Time complexity: O(log N log I).
+     */
+    int get_lca(int p, int q) const {
+        NodeInfo a = info(p), b = info(q);
+        while (a.head != b.head) {
+            NodeInfo head_a = info(a.head), head_b = info(b.head);
+            if (head_a.depth < head_b.depth) {
+                swap(p, q);
+                swap(a, b);
+                swap(head_a, head_b);
+            }
+            p = head_a.parent;
+            a = info(p);
+        }
+        return min(p, q); // On one chain the shallower node has the smaller position
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = sizeof(*this) + unique_bits.memory_bytes();
+        for (const vector<int>* array : {&node_pos, &fenwick, &unique_parent, &unique_depth, &unique_head, &unique_size,
+                                         &template_start, &template_parent, &template_depth, &template_head,
+                                         &template_size, &instance_start}) {
+            bytes += array->capacity() * sizeof(int);
+        }
+        return bytes + instances.capacity() * sizeof(Instance);
+    }
+
+private:
+    struct SignatureHash {
+        size_t operator()(const vector<int>& signature) const {
+            uint64_t h = 0x9e3779b97f4a7c15ULL ^ signature.size();
+            for (int x : signature) {
+                h ^= (uint64_t)x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            }
+            return (size_t)h;
+        }
+    };
+
+    struct Instance {
+        int template_id;
+        int root_depth;
+        int root_parent; // Position of the instance root's parent, -1 for the tree root
+        int root_head;   // Position of the instance root's chain head
+    };
+
+    struct NodeInfo {
+        int parent, depth, head, size; // Positions, except depth and size
+    };
+
+    int n;
+    int num_distinct_shapes;
+    vector<int> node_pos; // Caller id -> position
+    vector<int> fenwick;  // Values in position order (1-based Fenwick tree)
+
+    RankBitVector unique_bits; // Set for positions outside every instance
+    vector<int> unique_parent, unique_depth, unique_head, unique_size; // Indexed by rank among unique positions
+
+    vector<int> template_start; // Offset of each template in the flat template arrays
+    vector<int> template_parent, template_depth, template_head, template_size; // Relative to the instance root
+
+    vector<int> instance_start; // Sorted start positions, for binary search
+    vector<Instance> instances;
+
+    NodeInfo info(int p) const {
+        if (unique_bits.get(p)) {
+            size_t r = unique_bits.rank1(p);
+            return {unique_parent[r], unique_depth[r], unique_head[r], unique_size[r]};
+        }
+        size_t k = upper_bound(instance_start.begin(), instance_start.end(), p) - instance_start.begin() - 1;
+        const Instance& in = instances[k];
+        int start = instance_start[k];
+        int t = template_start[in.template_id] + (p - start);
+        return {p == start ? in.root_parent : start + template_parent[t],
+                in.root_depth + template_depth[t],
+                template_head[t] < 0 ? in.root_head : start + template_head[t],
+                template_size[t]};
+    }
+
+    void add(int p, int delta) {
+        for (int i = p + 1; i <= n; i += i & -i) fenwick[i] += delta;
+    }
+
+    int prefix_sum(int p) const { // Sum over positions [0, p)
+        int sum = 0;
+        for (int i = p; i > 0; i -= i & -i) sum += fenwick[i];
+        return sum;
+    }
+
+    int range_sum(int l, int r) const {
+        return prefix_sum(r + 1) - prefix_sum(l);
+    }
+};
+
+// --- Copy-on-write forks for what-if simulations ---
+class ForkableHLD {
+public:
+    /**
+     * @brief Wraps a built HLD whose decomposition is shared, read-only, by this object and all its forks.
+     *        Node values live in `pos` order in fixed-size pages under a persistent binary tree of page sums.
+     *        Tree nodes and pages are immutable and reference-counted, so fork() shares everything and
+     *        an update copies one page plus the O(log(N / kPageSize)) tree nodes above it.
+     *
+     * @note Time complexity: O(N). Space complexity: O(N).
+     */
+    explicit ForkableHLD(shared_ptr<const HLD> hld) : hld(move(hld)) {
+        const HLD& h = *this->hld;
+        vector<int> values_at_pos(h.size());
+        for (int u = 0; u < h.size(); ++u) {
+            values_at_pos[h.get_pos(u)] = h.get_node_value(u);
+        }
+        num_pages = (h.size() + kPageSize - 1) / kPageSize;
+        root = build(values_at_pos, 0, num_pages - 1);
+    }
+
+    /**
+     * @brief Returns an independent copy that shares all storage until either side writes.
+     * @note Time complexity: O(1).
+     */
+    ForkableHLD fork() const {
+        return *this;
+    }
+
+    /**
+     * @brief Sets the value of node u in this fork only.
+     * @note Time complexity: O(kPageSize + log N); allocates one page and O(log N) tree nodes.
+     */
+    void update_node_value(int u, int new_value) {
+        root = update(root, 0, num_pages - 1, hld->get_pos(u), new_value);
+    }
+
+    int get_node_value(int u) const {
+        int p = hld->get_pos(u);
+        const Node* node = root.get();
+        int lo = 0, hi = num_pages - 1;
+        while (lo != hi) {
+            int mid = (lo + hi) / 2;
+            if (p / kPageSize <= mid) node = node->left.get(), hi = mid;
+            else node = node->right.get(), lo = mid + 1;
+        }
+        return node->page->values[p % kPageSize];
+    }
+
+    /**
+     * @brief Sums the values of this fork on the path between u and v.
+     * @note Time complexity: O(log N (log N + kPageSize)).
+     */
+    int query_path(int u, int v) const {
+        int result = 0;
+        hld->for_each_path_segment(u, v, [&](int l, int r) {
+            result += query(root.get(), 0, num_pages - 1, l, r);
+        });
+        return result;
+    }
+
+    static constexpr int kPageSize = 64;
+
+private:
+    struct Page {
+        int values[kPageSize];
+    };
+
+    struct Node {
+        int sum;
+        shared_ptr<const Node> left, right; // Internal nodes only
+        shared_ptr<const Page> page;        // Leaves only
+    };
+
+    shared_ptr<const HLD> hld;
+    int num_pages;
+    shared_ptr<const Node> root;
+
+    shared_ptr<const Node> build(const vector<int>& values_at_pos, int lo, int hi) {
+        auto node = make_shared<Node>();
+        if (lo == hi) {
+            auto page = make_shared<Page>();
+            node->sum = 0;
+            for (int i = 0; i < kPageSize; ++i) {
+                int p = lo * kPageSize + i;
+                page->values[i] = p < (int)values_at_pos.size() ? values_at_pos[p] : 0;
+                node->sum += page->values[i];
+            }
+            node->page = move(page);
+            return node;
+        }
+        int mid = (lo + hi) / 2;
+        node->left = build(values_at_pos, lo, mid);
+        node->right = build(values_at_pos, mid + 1, hi);
+        node->sum = node->left->sum + node->right->sum;
+        return node;
+    }
+
+    // Returns a new version of `node` with position p set; untouched children and pages are shared.
+    shared_ptr<const Node> update(const shared_ptr<const Node>& node, int lo, int hi, int p, int value) {
+        auto copy = make_shared<Node>(*node);
+        if (lo == hi) {
+            auto page = make_shared<Page>(*node->page);
+            copy->sum += value - page->values[p % kPageSize];
+            page->values[p % kPageSize] = value;
+            copy->page = move(page);
+            return copy;
+        }
+        int mid = (lo + hi) / 2;
+        if (p / kPageSize <= mid) copy->left = update(node->left, lo, mid, p, value);
+        else copy->right = update(node->right, mid + 1, hi, p, value);
+        copy->sum = copy->left->sum + copy->right->sum;
+        return copy;
+    }
+
+    // Sums positions [l, r] within the pages [lo, hi] covered by node.
+    int query(const Node* node, int lo, int hi, int l, int r) const {
+        int first = lo * kPageSize, last = (hi + 1) * kPageSize - 1;
+        if (r < first || last < l) return 0;
+        if (l <= first && last <= r) return node->sum;
+        if (lo == hi) {
+            int sum = 0;
+            for (int p = max(l, first); p <= min(r, last); ++p) sum += node->page->values[p - first];
+            return sum;
+        }
+        int mid = (lo + hi) / 2;
+        return query(node->left.get(), lo, mid, l, r) + query(node->right.get(), mid + 1, hi, l, r);
+    }
+};
+
+// --- Top-k largest values on a path ---
+template <int K = 32>
+class PathTopKIndex : public PathMonoidIndex<TopKMonoid<K>> {
+public:
+    /**
+     * @brief Keeps the K largest (value, node) keys of every segment tree range. Each segment tree node holds
+     *        K 64-bit keys, so memory is about 4N * 8K bytes; pick a smaller K when fewer results are needed.
+     *
+     * @note Time complexity: O(N K).
+     */
+    explicit PathTopKIndex(const HLD& hld) : PathMonoidIndex<TopKMonoid<K>>(hld, node_keys(hld)) {}
+
+    /**
+     * @brief Sets the value of node u in this index.
+     * @note Time complexity: O(K log N).
+     */
+    void update_node_value(int u, int value) {
+        this->set_node(u, TopKMonoid<K>::single_key(make_key(value, u)));
+    }
+
+    /**
+     * @brief Finds the k largest values on the path between u and v, ties broken by larger node id.
+     *        Chain segments are merged into one fixed-size buffer on the stack; nothing is heap-allocated.
+     * @param k 1 <= k <= K.
+     * @param nodes Output array with room for k node ids, in descending value order.
+     * @param values Optional output array with room for k values (may be nullptr).
+     * @return The number of results written, min(k, number of nodes on the path).
+     *
+     * @note Time complexity: O(K log^2 N).
+     */
+    int query_path_topk(int u, int v, int k, int* nodes, int* values = nullptr) const {
+        assert(1 <= k && k <= K);
+        TopKList<K> best = this->query_path(u, v);
+        int written = min(k, best.count);
+        for (int i = 0; i < written; ++i) {
+            nodes[i] = (int)(uint32_t)best.keys[i];
+            if (values) values[i] = (int)(best.keys[i] >> 32);
+        }
+        return written;
+    }
+
+private:
+    // Orders by value, then node id, with a single 64-bit comparison.
+    static int64_t make_key(int value, int node) {
+        return (int64_t)((uint64_t)(int64_t)value << 32) | (uint32_t)node;
+    }
+
+    static vector<TopKList<K>> node_keys(const HLD& hld) {
+        vector<TopKList<K>> keys(hld.size());
+        for (int u = 0; u < hld.size(); ++u) keys[u] = TopKMonoid<K>::single_key(make_key(hld.get_node_value(u), u));
+        return keys;
+    }
+};
+
+// --- Approximate distinct counts on a path ---
+template <int P = 6>
+class PathDistinctIndex : public PathMonoidIndex<HyperLogLogMonoid<P>> {
+public:
+    /**
+     * @brief Each segment tree node holds a 2^P-byte HyperLogLog sketch; larger P trades memory for accuracy.
+     *        Construction is O(N 2^P), updates O(2^P log N).
+     */
+    using PathMonoidIndex<HyperLogLogMonoid<P>>::PathMonoidIndex;
+
+    /**
+     * @brief Estimates the number of distinct values on the path between u and v.
+     * @note Time complexity: O(2^P log^2 N).
+     */
+    double query_path_distinct(int u, int v) const {
+        return this->query_path(u, v).estimate();
+    }
+};
+
+// --- Approximate quantiles on a path ---
+template <int C = 64>
+class PathQuantileIndex : public PathMonoidIndex<QuantileSketchMonoid<C>> {
+public:
+    /**
+     * @brief Each segment tree node holds a t-digest of up to C centroids (12 bytes each); larger C is more
+     *        accurate. Construction is O(N C), updates O(C log N).
+     */
+    using PathMonoidIndex<QuantileSketchMonoid<C>>::PathMonoidIndex;
+
+    /**
+     * @brief Estimates the q-quantile (0 <= q <= 1) of the values on the path between u and v.
+     * @note Time complexity: O(C log^2 N).
+     */
+    double query_path_quantile(int u, int v, double q) const {
+        return this->query_path(u, v).quantile(q);
+    }
+};
+
+// --- Succinct balanced-parentheses tree ---
+class SuccinctTree {
+public:
+    /**
+     * @brief Encodes a rooted tree as a 2n-bit balanced-parentheses sequence: a DFS writes 1 on entering and 0 on
+     *        leaving each node. Node k is the node with preorder rank k, and its 1 is the k-th set bit. Every
+     *        navigation reduces to searches on the excess E(i) = (ones - zeros) in [0, i]: a range-min tree over
+     *        blocks of kBlockBits bits narrows a search to one block, which is then scanned bit by bit. Values are
+     *        stored offset by their minimum in the fewest bits that hold the range.
+     *        Topology costs about 2 (bits) + 1 (rank) + 0.5 (min tree) bits per node.
+     * @param parent_in_preorder parent_in_preorder[k] is the preorder rank of node k's parent; -1 for node 0, the
+     *        root, and less than k otherwise, with every node's parent on the current root path.
+     * @param values_in_preorder The value of every node, by preorder rank.
+     *
+     * @note Time complexity: O(n).
+     */
+    SuccinctTree(const vector<int>& parent_in_preorder, const vector<int>& values_in_preorder)
+        : n((int)parent_in_preorder.size()), bits(2 * (size_t)n) {
+        assert(n > 0 && (int)values_in_preorder.size() == n && parent_in_preorder[0] == -1);
+        size_t i = 0;
+        vector<int> open_nodes;
+        for (int k = 0; k < n; ++k) {
+            while (!open_nodes.empty() && open_nodes.back() != parent_in_preorder[k]) {
+                open_nodes.pop_back();
+                ++i; // Leaves a node: 0 bit
+            }
+            assert(k == 0 || !open_nodes.empty());
+            bits.set(i++);
+            open_nodes.push_back(k);
+        }
+        bits.build_rank();
+        bits.build_select();
+        build_min_tree();
+        pack_values(values_in_preorder);
+    }
+
+    /**
+     * @brief Encodes a built HLD using its heavy-first `pos` as the preorder, so node k here is the node at pos k.
+     * @note Time complexity: O(n).
+     */
+    static SuccinctTree from_hld(const HLD& hld) {
+        vector<int> parent_in_preorder(hld.size()), values_in_preorder(hld.size());
+        for (int u = 0; u < hld.size(); ++u) {
+            int p = hld.get_parent(u);
+            parent_in_preorder[hld.get_pos(u)] = (p == -1) ? -1 : hld.get_pos(p);
+            values_in_preorder[hld.get_pos(u)] = hld.get_node_value(u);
+        }
+        return SuccinctTree(parent_in_preorder, values_in_preorder);
+    }
+
+    int size() const { return n; }
+
+    int get_node_value(int k) const {
+        size_t bit = (size_t)k * value_bits;
+        uint64_t x = value_words[bit >> 6] >> (bit & 63);
+        if ((bit & 63) + value_bits > 64) x |= value_words[(bit >> 6) + 1] << (64 - (bit & 63));
+        return (int)(value_min + (int64_t)(x & value_mask()));
+    }
+
+    /** @note Time complexity: O(log n). */
+    int get_depth(int k) const {
+        return excess(open_position(k)) - 1;
+    }
+
+    /**
+     * @brief Number of nodes in the subtree of k; the subtree is the preorder range [k, k + size).
+     * @note Time complexity: O(block + log n).
+     */
+    int get_subtree_size(int k) const {
+        size_t open = open_position(k);
+        return (int)((find_close(open) - open + 1) / 2);
+    }
+
+    pair<int, int> subtree_range(int k) const {
+        return {k, k + get_subtree_size(k)};
+    }
+
+    /**
+     * @brief The ancestor d levels above k (k itself for d = 0), or -1 if d exceeds the depth of k.
+     * @note Time complexity: O(block + log n).
+     */
+    int kth_ancestor(int k, int d) const {
+        size_t open = open_position(k);
+        int target = excess(open) - 1 - d;
+        if (target < 0) return -1;
+        // The ancestor opens right after the last position before `open` whose excess is target.
+        return (int)bits.rank1(backward_search(open, target) + 1);
+    }
+
+    int get_parent(int k) const {
+        return kth_ancestor(k, 1);
+    }
+
+    /** @note Time complexity: O(block + log n). */
+    bool is_ancestor(int a, int k) const {
+        return a <= k && k < a + get_subtree_size(a);
+    }
+
+    /**
+     * @brief Lowest common ancestor. For a before b in preorder, with neither an ancestor of the other, the minimum
+     *        excess between their opening bits, m, is reached where the LCA's child holding a closes; the LCA is the
+     *        node opened right after the last position before a's with excess m - 1.
+     * @note Time complexity: O(block + log n).
+     */
+    int get_lca(int a, int b) const {
+        if (a > b) swap(a, b);
+        if (is_ancestor(a, b)) return a;
+        size_t open_a = open_position(a);
+        int m = range_min_excess(open_a, open_position(b));
+        return (int)bits.rank1(backward_search(open_a, m - 1) + 1);
+    }
+
+    size_t memory_bytes() const {
+        return sizeof(*this) + bits.memory_bytes() + min_tree.capacity() * sizeof(int32_t) +
+               value_words.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    static constexpr size_t kBlockBits = 256;
+
+    int n;
+    RankBitVector bits;
+    size_t num_leaves; // Leaves of the min tree: a power of two >= number of blocks
+    vector<int32_t> min_tree; // min_tree[num_leaves + b] = minimum excess over block b; inner nodes hold minima
+    int value_min;
+    int value_bits;
+    vector<uint64_t> value_words;
+
+    uint64_t value_mask() const { return value_bits == 64 ? ~0ULL : (1ULL << value_bits) - 1; }
+
+    size_t open_position(int k) const { return bits.select1(k); }
+
+    // E(i): excess over positions [0, i]; E(-1) = 0.
+    int excess(size_t i) const {
+        return (int)(2 * bits.rank1(i + 1)) - (int)(i + 1);
+    }
+
+    void build_min_tree() {
+        size_t num_blocks = (bits.size() + kBlockBits - 1) / kBlockBits;
+        num_leaves = 1;
+        while (num_leaves < num_blocks) num_leaves *= 2;
+        min_tree.assign(2 * num_leaves, numeric_limits<int32_t>::max());
+        int e = 0;
+        for (size_t i = 0; i < bits.size(); ++i) {
+            e += bits.get(i) ? 1 : -1;
+            int32_t& leaf = min_tree[num_leaves + i / kBlockBits];
+            leaf = min(leaf, (int32_t)e);
+        }
+        for (size_t x = num_leaves - 1; x >= 1; --x) {
+            min_tree[x] = min(min_tree[2 * x], min_tree[2 * x + 1]);
+        }
+    }
+
+    void pack_values(const vector<int>& values) {
+        auto range = minmax_element(values.begin(), values.end());
+        value_min = *range.first;
+        uint64_t span = (uint64_t)((int64_t)*range.second - *range.first);
+        value_bits = 1;
+        while (value_bits < 64 && (span >> value_bits)) ++value_bits;
+        value_words.assign(((size_t)n * value_bits + 63) / 64 + 1, 0);
+        for (int k = 0; k < n; ++k) {
+            uint64_t x = (uint64_t)((int64_t)values[k] - value_min);
+            size_t bit = (size_t)k * value_bits;
+            value_words[bit >> 6] |= x << (bit & 63);
+            if ((bit & 63) + value_bits > 64) value_words[(bit >> 6) + 1] |= x >> (64 - (bit & 63));
+        }
+    }
+
+    // Position of the 0 matching the 1 at `open`: the first j > open with E(j) = E(open) - 1. Excess moves by one
+    // per bit, so a block whose minimum is at or below the target contains it.
+    size_t find_close(size_t open) const {
+        int target = excess(open) - 1;
+        size_t block = open / kBlockBits;
+        int e = excess(open);
+        size_t end = min(bits.size(), (block + 1) * kBlockBits);
+        for (size_t j = open + 1; j < end; ++j) {
+            e += bits.get(j) ? 1 : -1;
+            if (e == target) return j;
+        }
+        // Leftmost later block whose minimum reaches target.
+        size_t x = num_leaves + block + 1;
+        while (min_tree[x] > target) {
+            while (x & 1) x >>= 1;
+            x += 1;
+        }
+        while (x < num_leaves) {
+            x = 2 * x;
+            if (min_tree[x] > target) ++x;
+        }
+        size_t j = (x - num_leaves) * kBlockBits;
+        for (e = excess(j - 1); ; ++j) {
+            e += bits.get(j) ? 1 : -1;
+            if (e == target) return j;
+        }
+    }
+
+    // Last position j < i with E(j) = target, for target <= E(i - 1); (size_t)-1 when only E(-1) = 0 qualifies.
+    size_t backward_search(size_t i, int target) const {
+        size_t block = i / kBlockBits;
+        int e = excess(i) - (bits.get(i) ? 1 : -1); // E(i - 1)
+        for (size_t j = i; j-- > block * kBlockBits;) {
+            if (e == target) return j;
+            e -= bits.get(j) ? 1 : -1;
+        }
+        // e is now E(block start - 1); the rightmost earlier block whose minimum reaches target holds the answer.
+        if (block == 0) return (size_t)-1;
+        size_t x = num_leaves + block - 1;
+        while (min_tree[x] > target) {
+            while (!(x & 1) && x > 1) x >>= 1;
+            if (x == 1) return (size_t)-1; // Only E(-1) = 0 remains
+            x -= 1;
+        }
+        while (x < num_leaves) {
+            x = 2 * x + 1;
+            if (min_tree[x] > target) --x;
+        }
+        size_t j = (x - num_leaves + 1) * kBlockBits - 1;
+        for (e = excess(j); ; --j) {
+            if (e == target) return j;
+            e -= bits.get(j) ? 1 : -1;
+        }
+    }
+
+    // Minimum of E(j) over j in [l, r].
+    int range_min_excess(size_t l, size_t r) const {
+        size_t lb = l / kBlockBits, rb = r / kBlockBits;
+        int e = excess(l), best = e;
+        size_t end = (lb == rb) ? r + 1 : (lb + 1) * kBlockBits;
+        for (size_t j = l + 1; j < end; ++j) {
+            e += bits.get(j) ? 1 : -1;
+            best = min(best, e);
+        }
+        if (lb == rb) return best;
+        for (size_t lo = num_leaves + lb + 1, hi = num_leaves + rb; lo < hi; lo >>= 1, hi >>= 1) {
+            if (lo & 1) best = min(best, (int)min_tree[lo++]);
+            if (hi & 1) best = min(best, (int)min_tree[--hi]);
+        }
+        e = excess(rb * kBlockBits - 1);
+        for (size_t j = rb * kBlockBits; j <= r; ++j) {
+            e += bits.get(j) ? 1 : -1;
+            best = min(best, e);
+        }
+        return best;
+    }
+};
+
+// --- Aggregates over the descendants at a given depth ---
+class LevelSubtreeIndex {
+public:
+    /**
+     * @brief Groups the nodes of a built HLD by depth, each level listing its nodes' `pos` in increasing order
+     *        (a single scan in `pos` order appends them already sorted). The descendants of u at depth D are then
+     *        the entries of level D inside the subtree interval [pos[u], pos[u] + subtree_size[u]), found by two
+     *        binary searches. Each level keeps its values in its own Fenwick tree for point updates; all levels
+     *        share flat arrays indexed from level_start.
+     *
+     * @note Time complexity: O(N). Space complexity: 3N + max depth ints.
+     */
+    explicit LevelSubtreeIndex(const HLD& hld) : hld(hld), slot(hld.size()) {
+        int n = hld.size();
+        vector<int> node_at(n);
+        int max_depth = 0;
+        for (int u = 0; u < n; ++u) {
+            node_at[hld.get_pos(u)] = u;
+            max_depth = max(max_depth, hld.get_depth(u));
+        }
+        level_start.assign(max_depth + 2, 0);
+        for (int u = 0; u < n; ++u) ++level_start[hld.get_depth(u) + 1];
+        partial_sum(level_start.begin(), level_start.end(), level_start.begin());
+
+        vector<int> fill_at(level_start.begin(), level_start.end() - 1);
+        level_pos.resize(n);
+        fenwick.assign(n, 0);
+        for (int p = 0; p < n; ++p) {
+            int u = node_at[p];
+            int i = fill_at[hld.get_depth(u)]++;
+            level_pos[i] = p;
+            fenwick[i] = hld.get_node_value(u);
+            slot[u] = i;
+        }
+        // Linear Fenwick build inside each level: push each entry into its parent slot.
+        for (int d = 0; d <= max_depth; ++d) {
+            int base = level_start[d], len = level_start[d + 1] - base;
+            for (int i = 1; i <= len; ++i) {
+                int up = i + (i & -i);
+                if (up <= len) fenwick[base + up - 1] += fenwick[base + i - 1];
+            }
+        }
+    }
+
+    /**
+     * @brief Sets the value of node u in this index.
+     * @note Time complexity: O(log N).
+     */
+    void update_node_value(int u, int value) {
+        int d = hld.get_depth(u);
+        int base = level_start[d], len = level_start[d + 1] - base;
+        int i = slot[u] - base + 1;
+        int delta = value - (prefix_sum(d, i) - prefix_sum(d, i - 1));
+        for (; i <= len; i += i & -i) fenwick[base + i - 1] += delta;
+    }
+
+    /**
+     * @brief Number of descendants of u exactly d levels below it (d = 0 counts u itself).
+     * @note Time complexity: O(log N).
+     */
+    int count_at_depth(int u, int d) const {
+        pair<int, int> range = level_range(u, d);
+        return range.second - range.first;
+    }
+
+    /**
+     * @brief Sum of the values of the descendants of u exactly d levels below it.
+     * @note Time complexity: O(log N).
+     */
+    int sum_at_depth(int u, int d) const {
+        pair<int, int> range = level_range(u, d);
+        if (range.first == range.second) return 0;
+        int level = hld.get_depth(u) + d;
+        int base = level_start[level];
+        return prefix_sum(level, range.second - base) - prefix_sum(level, range.first - base);
+    }
+
+    /**
+     * @brief Sum of the values of the descendants of u between d_lo and d_hi levels below it, inclusive.
+     * @note Time complexity: O((d_hi - d_lo + 1) log N).
+     */
+    int sum_depth_range(int u, int d_lo, int d_hi) const {
+        int sum = 0;
+        int last = min(d_hi, (int)level_start.size() - 2 - hld.get_depth(u));
+        for (int d = max(d_lo, 0); d <= last; ++d) sum += sum_at_depth(u, d);
+        return sum;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = sizeof(*this);
+        for (const vector<int>* array : {&slot, &level_start, &level_pos, &fenwick}) {
+            bytes += array->capacity() * sizeof(int);
+        }
+        return bytes;
+    }
+
+private:
+    const HLD& hld;
+    vector<int> slot;        // Index of each node in level_pos
+    vector<int> level_start; // Level d occupies [level_start[d], level_start[d + 1])
+    vector<int> level_pos;   // `pos` of each node, grouped by depth and increasing within a level
+    vector<int> fenwick;     // One 1-based Fenwick tree per level, over the same slots as level_pos
+
+    // Slots of level depth(u) + d that fall inside the subtree of u.
+    pair<int, int> level_range(int u, int d) const {
+        int level = hld.get_depth(u) + d;
+        if (d < 0 || level + 1 >= (int)level_start.size()) return {0, 0};
+        auto first = level_pos.begin() + level_start[level], last = level_pos.begin() + level_start[level + 1];
+        int lo = hld.get_pos(u), hi = lo + hld.get_subtree_size(u);
+        return {(int)(lower_bound(first, last, lo) - level_pos.begin()),
+                (int)(lower_bound(first, last, hi) - level_pos.begin())};
+    }
+
+    int prefix_sum(int level, int count) const { // Sum over the first `count` slots of a level
+        int base = level_start[level], sum = 0;
+        for (int i = count; i > 0; i -= i & -i) sum += fenwick[base + i - 1];
+        return sum;
+    }
+};
+
+// --- Maximum subset XOR on a path ---
+template <int B = 32>
+class PathXorBasisIndex : public PathMonoidIndex<XorBasisMonoid<B>> {
+public:
+    /**
+     * @brief Each segment tree node holds a linear basis of B 64-bit vectors over the node values read as
+     *        unsigned words (B = 32 covers every int value). Construction is O(N B^2), updates O(B^2 log N).
+     */
+    using PathMonoidIndex<XorBasisMonoid<B>>::PathMonoidIndex;
+
+    /**
+     * @brief The largest XOR of any subset of the values on the path between u and v.
+     * @note Time complexity: O(B^2 log^2 N).
+     */
+    uint64_t query_path_max_xor(int u, int v) const {
+        return this->query_path(u, v).max_xor();
+    }
+};
+
+template <int B = 32>
+class PathXorPrefixBasis {
+public:
+    /**
+     * @brief Static alternative to PathXorBasisIndex without a segment tree. Every node keeps the basis of its
+     *        root path in which each vector remembers the depth of the deepest node it came from; insertion prefers
+     *        deeper vectors (swapping them down), so the vectors with depth >= d span exactly the path values at
+     *        depth >= d. A node's basis extends its parent's, built in `pos` (pre)order.
+     *
+     * @note Time complexity: O(N B). Space complexity: 12 N B bytes.
+     */
+    explicit PathXorPrefixBasis(const HLD& hld)
+        : hld(hld), vectors((size_t)hld.size() * B, 0), vector_depth((size_t)hld.size() * B, -1) {
+        int n = hld.size();
+        vector<int> node_at(n);
+        for (int u = 0; u < n; ++u) node_at[hld.get_pos(u)] = u;
+        for (int p = 0; p < n; ++p) {
+            int u = node_at[p], parent = hld.get_parent(u);
+            uint64_t* basis = &vectors[(size_t)u * B];
+            int* depth_of = &vector_depth[(size_t)u * B];
+            if (parent != -1) {
+                copy(&vectors[(size_t)parent * B], &vectors[(size_t)parent * B] + B, basis);
+                copy(&vector_depth[(size_t)parent * B], &vector_depth[(size_t)parent * B] + B, depth_of);
+            }
+            uint64_t x = (uint32_t)hld.get_node_value(u);
+            int d = hld.get_depth(u);
+            for (int i = B - 1; i >= 0 && x; --i) {
+                if (!((x >> i) & 1)) continue;
+                if (!basis[i]) {
+                    basis[i] = x;
+                    depth_of[i] = d;
+                    break;
+                }
+                if (depth_of[i] < d) {
+                    swap(basis[i], x);
+                    swap(depth_of[i], d);
+                }
+                x ^= basis[i];
+            }
+        }
+    }
+
+    /**
+     * @brief The largest XOR of any subset of the values on the path between u and v: the vectors of u's and v's
+     *        prefix bases at or below the LCA's depth, merged.
+     * @note Time complexity: O(log N + B^2).
+     */
+    uint64_t query_path_max_xor(int u, int v) const {
+        int min_depth = hld.get_depth(hld.get_lca(u, v));
+        XorBasis<B> merged = XorBasisMonoid<B>::identity();
+        for (int x : {u, v}) {
+            for (int i = B - 1; i >= 0; --i) {
+                if (vector_depth[(size_t)x * B + i] >= min_depth) merged.insert(vectors[(size_t)x * B + i]);
+            }
+        }
+        return merged.max_xor();
+    }
+
+private:
+    const HLD& hld;
+    vector<uint64_t> vectors; // vectors[u * B + i]: basis vector i of the root path of u
+    vector<int> vector_depth; // Depth of the deepest node vector i came from, -1 if empty
+};
+
+#ifdef HLD_HAS_COROUTINES
+// --- Coroutine batching for path queries ---
+class PathQueryBatcher {
+public:
+    struct Request {
+        HLD* hld;
+        int u;
+        int v;
+        int* result;
+        coroutine_handle<> waiter;
+    };
+
+    /**
+     * @brief Returns the batcher of the calling thread.
+     *        Coroutines suspended here are resumed on this thread by flush().
+     */
+    static PathQueryBatcher& local() {
+        thread_local PathQueryBatcher batcher;
+        return batcher;
+    }
+
+    void enqueue(const Request& request) {
+        pending_requests.push_back(request);
+    }
+
+    size_t pending() const {
+        return pending_requests.size();
+    }
+
+    /**
+     * @brief Answers every queued request and resumes the waiting coroutines.
+     *        Requests are grouped per HLD instance and answered with one query_path_batch call per
+     *        group. Coroutines that issue further queries when resumed are served by the next
+     *        round; flush returns once nothing is pending. Call it from the event loop once per tick.
+     *
+     * @return The number of requests answered.
+     */
+    size_t flush() {
+        HLD_TRACE_SCOPE("PathQueryBatcher::flush");
+        size_t answered = 0;
+        vector<Request> round;
+        vector<int> pairs, results;
+        while (!pending_requests.empty()) {
+            round.swap(pending_requests);
+            stable_sort(round.begin(), round.end(),
+                        [](const Request& a, const Request& b) { return a.hld < b.hld; });
+
+            for (size_t begin = 0; begin < round.size();) {
+                size_t end = begin;
+                pairs.clear();
+                while (end < round.size() && round[end].hld == round[begin].hld) {
+                    pairs.push_back(round[end].u);
+                    pairs.push_back(round[end].v);
+                    ++end;
+                }
+                results.resize(end - begin);
+                round[begin].hld->query_path_batch(pairs.data(), end - begin, results.data());
+                for (size_t i = begin; i < end; ++i) {
+                    *round[i].result = results[i - begin];
+                }
+                begin = end;
+            }
+
+            answered += round.size();
+            for (const Request& request : round) {
+                request.waiter.resume();
+            }
+            round.clear();
+        }
+        return answered;
+    }
+
+private:
+    vector<Request> pending_requests;
+};
+
+class PathQueryAwaitable {
+public:
+    PathQueryAwaitable(HLD* hld, int u, int v) : hld(hld), u(u), v(v), result(0) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(coroutine_handle<> waiter) {
+        PathQueryBatcher::local().enqueue({hld, u, v, &result, waiter});
+    }
+
+    int await_resume() const noexcept {
+        return result;
+    }
+
+private:
+    HLD* hld;
+    int u;
+    int v;
+    int result; // Written by PathQueryBatcher::flush before the waiter is resumed
+};
+
+inline PathQueryAwaitable HLD::query_path_async(int u, int v) {
+    return PathQueryAwaitable(this, u, v);
+}
+#endif // HLD_HAS_COROUTINES
+
+/**
+ * @brief Publishes node count, chain count and memory size of a built HLD as gauges.
+ *        Call before rendering; gauges keep their last value.
+ */
+inline void export_hld_gauges(MetricsRegistry& registry, const HLD& hld) {
+    registry.set_gauge("hld_nodes", "Number of tree nodes.", hld.size());
+    registry.set_gauge("hld_chains", "Number of heavy chains.", hld.num_chains());
+    registry.set_gauge("hld_memory_bytes", "Approximate heap bytes held by the HLD.", (double)hld.memory_bytes());
+}
+
+// --- Offline path maxima for MST verification ---
+/**
+ * @brief Computes the maximum edge weight on the tree path of many node pairs at once.
+ *        Tree edges are merged with a DSU in ascending weight order (Kruskal); each merge becomes an internal
+ *        node of a Kruskal reconstruction tree carrying the edge weight. The maximum on the path u-v is the
+ *        weight at the LCA of u and v in that tree, answered by an HLD over it. This replaces a per-pair
+ *        O(log^2 N) path-max query with O(log N) LCA lookups after one O(N log N) sort.
+ * @param tree A built HLD of the spanning tree.
+ * @param edge_weight_to_parent edge_weight_to_parent[v] is the weight of edge (parent(v), v); the root's entry is ignored.
+ * @param pairs Flat array of endpoints {u0, v0, u1, v1, ...}.
+ * @param count The number of pairs.
+ * @param results Output array; INT_MIN where u == v (empty path).
+ *
+ * @note Time complexity: O(N log N + count log N).
+ */
+inline void path_max_edge_batch(const HLD& tree, const vector<int>& edge_weight_to_parent,
+                                const int* pairs, size_t count, int* results) {
+    int n = tree.size();
+    vector<int> edges; // Non-root nodes, each standing for the edge to its parent
+    edges.reserve(n - 1);
+    for (int v = 0; v < n; ++v) {
+        if (tree.get_parent(v) != -1) edges.push_back(v);
+    }
+    sort(edges.begin(), edges.end(), [&](int a, int b) { return edge_weight_to_parent[a] < edge_weight_to_parent[b]; });
+
+    // Kruskal reconstruction tree: leaves 0..n-1, internal nodes n..2n-2 in merge order.
+    vector<int> dsu(n), component_node(n);
+    iota(dsu.begin(), dsu.end(), 0);
+    iota(component_node.begin(), component_node.end(), 0);
+    auto find = [&](int x) {
+        while (dsu[x] != x) x = dsu[x] = dsu[dsu[x]];
+        return x;
+    };
+    vector<int> merge_weight(2 * n - 1, numeric_limits<int>::min());
+    HLD reconstruction(2 * n - 1, vector<int>(2 * n - 1, 0));
+    int next_node = n;
+    for (int v : edges) {
+        int a = find(v), b = find(tree.get_parent(v));
+        reconstruction.add_edge(next_node, component_node[a]);
+        reconstruction.add_edge(next_node, component_node[b]);
+        merge_weight[next_node] = edge_weight_to_parent[v];
+        dsu[a] = b;
+        component_node[b] = next_node++;
+    }
+    reconstruction.build(next_node - 1);
+
+    for (size_t i = 0; i < count; ++i) {
+        results[i] = merge_weight[reconstruction.get_lca(pairs[2 * i], pairs[2 * i + 1])];
+    }
+}
+
+/**
+ * @brief Checks non-tree edges (u, v, w) against a spanning tree: exceeds[i] is 1 if w is greater than the
+ *        maximum tree-edge weight on the path u-v. A spanning tree is minimum iff no non-tree edge has w
+ *        below that maximum.
+ * @param edges Flat array of triples {u0, v0, w0, u1, v1, w1, ...}.
+ *
+ * @note Time complexity: O(N log N + count log N).
+ */
+inline void non_tree_edges_exceed_path_max(const HLD& tree, const vector<int>& edge_weight_to_parent,
+                                           const int* edges, size_t count, uint8_t* exceeds) {
+    vector<int> pairs(2 * count), maxima(count);
+    for (size_t i = 0; i < count; ++i) {
+        pairs[2 * i] = edges[3 * i];
+        pairs[2 * i + 1] = edges[3 * i + 1];
+    }
+    path_max_edge_batch(tree, edge_weight_to_parent, pairs.data(), count, maxima.data());
+    for (size_t i = 0; i < count; ++i) {
+        exceeds[i] = (uint8_t)(edges[3 * i + 2] > maxima[i]);
+    }
+}
+
+// --- Linearizable mixed read/write batches with parallel query execution ---
+class MixedBatchExecutor {
+public:
+    struct Operation {
+        bool is_update;
+        int a; // Update: node. Query: first endpoint.
+        int b; // Update: new value. Query: second endpoint.
+
+        static Operation update(int node, int value) { return {true, node, value}; }
+        static Operation query(int u, int v) { return {false, u, v}; }
+    };
+
+    /**
+     * @brief Executes ops with the same results as running them one by one, in order.
+     *        A sequential pre-pass records each update as a (pos, op index, delta) triple. Queries then run in
+     *        parallel against the pre-batch tree: for every `pos` interval of its path, a query adds the deltas of
+     *        updates inside the interval with a smaller op index, a 2D dominance sum answered by EarlierUpdateSums
+     *        without visiting updates one by one. Finally each updated node is written once with its last value.
+     *        Relies on the path aggregate being an invertible sum.
+     * @param hld A built HLD; it reflects every update when execute returns.
+     * @param ops The operation stream.
+     * @param results results[i] receives the answer of query ops[i] (0 for updates).
+     * @param num_threads Worker threads for the query phase; 0 uses the hardware concurrency.
+     *
+     * @note Time complexity: O(U log^2 U + Q log N (log N + log^2 U)), with the queries spread over the workers.
+     */
+    static void execute(HLD& hld, const vector<Operation>& ops, vector<int>& results, int num_threads = 0) {
+        HLD_TRACE_SCOPE("MixedBatchExecutor::execute");
+        results.assign(ops.size(), 0);
+
+        vector<PendingUpdate> updates;
+        unordered_map<int, int> latest_value; // Node -> value after the updates seen so far
+        vector<int> queries;
+        for (int i = 0; i < (int)ops.size(); ++i) {
+            const Operation& op = ops[i];
+            if (!op.is_update) {
+                queries.push_back(i);
+                continue;
+            }
+            auto it = latest_value.find(op.a);
+            int old_value = (it == latest_value.end()) ? hld.get_node_value(op.a) : it->second;
+            updates.push_back({hld.get_pos(op.a), i, op.b - old_value});
+            latest_value[op.a] = op.b;
+        }
+        EarlierUpdateSums earlier(updates);
+
+        if (num_threads <= 0) num_threads = max(1u, thread::hardware_concurrency());
+        num_threads = (int)min<size_t>(num_threads, max<size_t>(1, queries.size() / kMinQueriesPerThread));
+        atomic<size_t> next_chunk(0);
+        auto worker = [&]() {
+            for (size_t begin; (begin = next_chunk.fetch_add(kChunkSize)) < queries.size();) {
+                size_t end = min(begin + kChunkSize, queries.size());
+                for (size_t q = begin; q < end; ++q) {
+                    int i = queries[q];
+                    int result = hld.query_path(ops[i].a, ops[i].b);
+                    if (!updates.empty()) {
+                        hld.for_each_path_segment(ops[i].a, ops[i].b, [&](int l, int r) {
+                            result += earlier.sum(r + 1, i) - earlier.sum(l, i);
+                        });
+                    }
+                    results[i] = result;
+                }
+            }
+        };
+        // Each worker records its own span, so a trace shows one track per thread.
+        auto traced_worker = [&worker]() {
+            HLD_TRACE_SCOPE("MixedBatchExecutor.worker");
+            worker();
+        };
+        vector<thread> workers;
+        for (int t = 1; t < num_threads; ++t) workers.emplace_back(traced_worker);
+        traced_worker();
+        for (thread& t : workers) t.join();
+
+        for (const auto& entry : latest_value) {
+            hld.update_node_value(entry.first, entry.second);
+        }
+    }
+
+private:
+    static constexpr size_t kChunkSize = 256; // Queries claimed per atomic increment
+    // Starting a thread costs tens of microseconds, about as much as a thousand O(log^2 N) path queries.
+    static constexpr size_t kMinQueriesPerThread = 1024;
+
+    struct PendingUpdate {
+        int pos;
+        int op_index;
+        int delta;
+    };
+
+    /**
+     * @brief Static, thread-safe sums of update deltas over pos prefixes and op-index prefixes: a Fenwick tree over
+     *        the updates in pos order whose node k holds the op indices of the lowbit(k) updates it covers, sorted,
+     *        with running delta sums.
+     */
+    class EarlierUpdateSums {
+    public:
+        explicit EarlierUpdateSums(vector<PendingUpdate>& updates) {
+            sort(updates.begin(), updates.end(), [](const PendingUpdate& x, const PendingUpdate& y) {
+                return x.pos < y.pos;
+            });
+            int u = (int)updates.size();
+            update_pos.resize(u);
+            node_start.assign(u + 2, 0);
+            for (int k = 1; k <= u; ++k) {
+                update_pos[k - 1] = updates[k - 1].pos;
+                node_start[k + 1] = node_start[k] + (k & -k);
+            }
+            vector<pair<int, int>> node; // (op index, delta)
+            node_ops.resize(node_start[u + 1]);
+            node_sums.resize(node_start[u + 1]);
+            for (int k = 1; k <= u; ++k) {
+                node.clear();
+                for (int j = k - (k & -k); j < k; ++j) node.push_back({updates[j].op_index, updates[j].delta});
+                sort(node.begin(), node.end());
+                int sum = 0;
+                for (size_t e = 0; e < node.size(); ++e) {
+                    sum += node[e].second;
+                    node_ops[node_start[k] + e] = node[e].first;
+                    node_sums[node_start[k] + e] = sum;
+                }
+            }
+        }
+
+        // Sum of the deltas of updates with pos < pos_limit and op index < op_limit. O(log^2 U).
+        int sum(int pos_limit, int op_limit) const {
+            int sum = 0;
+            int k = (int)(lower_bound(update_pos.begin(), update_pos.end(), pos_limit) - update_pos.begin());
+            for (; k > 0; k -= k & -k) {
+                auto first = node_ops.begin() + node_start[k], last = node_ops.begin() + node_start[k + 1];
+                int taken = (int)(lower_bound(first, last, op_limit) - first);
+                if (taken > 0) sum += node_sums[node_start[k] + taken - 1];
+            }
+            return sum;
+        }
+
+    private:
+        vector<int> update_pos; // pos of each update, sorted
+        vector<int> node_start; // Fenwick node k occupies [node_start[k], node_start[k + 1]) of node_ops/node_sums
+        vector<int> node_ops;
+        vector<int> node_sums;
+    };
+};
+
+// --- Startup auto-tuning of batch parameters ---
+struct HLDTuning {
+    int batch_width = HLD::kDefaultBatchWidth;
+};
+
+// A representative slice of the production operation mix, replayed by HLDAutoTuner::calibrate.
+struct HLDWorkloadSample {
+    vector<int> path_pairs; // {u0, v0, u1, v1, ...} for query_path_batch
+    vector<int> lca_pairs;  // {u0, v0, u1, v1, ...} for get_lca_batch
+    vector<int> updates;    // {node0, value0, node1, value1, ...} for update_node_values_batch
+};
+
+class HLDAutoTuner {
+public:
+    /**
+     * @brief Replays a sample of the real operation mix (path sums, LCAs and point updates, in that order) for
+     *        every candidate batch width and returns the fastest. Updates do not use the batch width, but they
+     *        are timed too because they evict the tree state the batched walks depend on. Candidates are
+     *        measured in interleaved rounds until the budget is spent, so frequency scaling and cache warm-up
+     *        affect all of them alike. The HLD's width and node values are restored.
+     * @param hld The built HLD to measure against.
+     * @param sample The operation mix; at least one path or LCA pair.
+     * @param budget Upper bound on measuring time (at least one round always runs).
+     */
+    static HLDTuning calibrate(HLD& hld, const HLDWorkloadSample& sample, chrono::milliseconds budget) {
+        HLD_TRACE_SCOPE("HLDAutoTuner::calibrate");
+        static const int candidates[] = {1, 2, 4, 8, 16, 32};
+        const int num_candidates = sizeof(candidates) / sizeof(candidates[0]);
+        size_t path_count = sample.path_pairs.size() / 2, lca_count = sample.lca_pairs.size() / 2;
+        size_t update_count = sample.updates.size() / 2;
+        assert(path_count + lca_count > 0);
+        vector<int> results(max(path_count, lca_count));
+        vector<chrono::nanoseconds> spent(num_candidates, chrono::nanoseconds(0));
+        int original_width = hld.get_batch_width();
+
+        // Writing the original values back after each replay keeps every candidate on the same tree.
+        vector<int> restore;
+        for (size_t i = 0; i < update_count; ++i) {
+            restore.push_back(sample.updates[2 * i]);
+            restore.push_back(hld.get_node_value(sample.updates[2 * i]));
+        }
+
+        auto deadline = chrono::steady_clock::now() + budget;
+        do {
+            for (int c = 0; c < num_candidates; ++c) {
+                hld.set_batch_width(candidates[c]);
+                auto start = chrono::steady_clock::now();
+                hld.query_path_batch(sample.path_pairs.data(), path_count, results.data());
+                hld.get_lca_batch(sample.lca_pairs.data(), lca_count, results.data());
+                hld.update_node_values_batch(sample.updates.data(), update_count);
+                spent[c] += chrono::steady_clock::now() - start;
+                hld.update_node_values_batch(restore.data(), update_count);
+            }
+        } while (chrono::steady_clock::now() < deadline);
+        hld.set_batch_width(original_width);
+
+        HLDTuning best;
+        best.batch_width = candidates[min_element(spent.begin(), spent.end()) - spent.begin()];
+        return best;
+    }
+
+    /**
+     * @brief Persists a tuning as "key=value" lines, tagged with the tree size it was measured on.
+     * @return true on success.
+     */
+    static bool save(const HLDTuning& tuning, int tree_size, const string& path) {
+        ofstream out(path);
+        out << "tree_size=" << tree_size << "\n"
+            << "batch_width=" << tuning.batch_width << "\n";
+        return (bool)out;
+    }
+
+    /**
+     * @brief Loads a tuning saved by save(). It is rejected when missing, unreadable, or measured on a tree
+     *        more than twice larger or smaller than tree_size, since cache behaviour depends on scale.
+     */
+    static bool load(const string& path, int tree_size, HLDTuning& tuning) {
+        ifstream in(path);
+        string line;
+        long long saved_size = -1;
+        HLDTuning loaded;
+        bool has_width = false;
+        while (getline(in, line)) {
+            size_t eq = line.find('=');
+            if (eq == string::npos) continue;
+            string key = line.substr(0, eq);
+            long long value = atoll(line.c_str() + eq + 1);
+            if (key == "tree_size") saved_size = value;
+            if (key == "batch_width" && value >= 1 && value <= HLD::kMaxBatchWidth) {
+                loaded.batch_width = (int)value;
+                has_width = true;
+            }
+        }
+        if (!has_width || saved_size <= 0 || saved_size > 2LL * tree_size || 2LL * saved_size < tree_size) {
+            return false;
+        }
+        tuning = loaded;
+        return true;
+    }
+
+    /**
+     * @brief Applies the tuning cached at path if it is still valid; otherwise calibrates, caches and applies it.
+     * @return The tuning now in effect.
+     */
+    static HLDTuning tune(HLD& hld, const HLDWorkloadSample& sample, const string& path, chrono::milliseconds budget) {
+        HLDTuning tuning;
+        if (!load(path, hld.size(), tuning)) {
+            tuning = calibrate(hld, sample, budget);
+            save(tuning, hld.size(), path);
+        }
+        hld.set_batch_width(tuning.batch_width);
+        return tuning;
+    }
+};
+
+// --- Compressed cold-storage archive ---
+// Layout: "HLDZ", then varints: format version, N, and three streams in `pos` order:
+//   node ids as zig-zag deltas from the previous id (the first from -1),
+//   for pos k >= 1 the distance k - pos[parent] (>= 1, usually 1 along heavy chains),
+//   node values as zig-zag varints.
+// Decoding rebuilds the HLD with build_from_preorder, skipping adjacency lists and DFS.
+static const char kHldArchiveMagic[4] = {'H', 'L', 'D', 'Z'};
+static constexpr uint64_t kHldArchiveVersion = 1;
+
+// Returns false if the buffer refused a byte (a full disk or a closed stream).
+inline bool write_varint(streambuf& out, uint64_t x) {
+    const int eof = char_traits<char>::eof();
+    while (x >= 0x80) {
+        if (out.sputc((char)(x | 0x80)) == eof) return false;
+        x >>= 7;
+    }
+    return out.sputc((char)x) != eof;
+}
+
+inline bool read_varint(streambuf& in, uint64_t& x) {
+    x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.sbumpc();
+        if (byte == char_traits<char>::eof()) return false;
+        x |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag_encode(int64_t x) {
+    return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t x) {
+    return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+/**
+ * @brief Writes a built HLD (topology, current node values and its `pos` order) as a compact archive.
+ * @return false, with badbit set on out, if the stream has no buffer or a write came up short; the archive
+ *         is then truncated and must not be kept.
+ *
+ * @note Time complexity: O(N).
+ */
+inline bool write_hld_archive(const HLD& hld, ostream& out) {
+    HLD_TRACE_SCOPE("write_hld_archive");
+    int n = hld.size();
+    vector<int> order(n);
+    for (int u = 0; u < n; ++u) {
+        order[hld.get_pos(u)] = u;
+    }
+
+    auto fail = [&out]() {
+        out.setstate(ios::badbit);
+        return false;
+    };
+    if (out.rdbuf() == nullptr) return fail();
+    streambuf& buf = *out.rdbuf();
+    if (buf.sputn(kHldArchiveMagic, sizeof(kHldArchiveMagic)) != (streamsize)sizeof(kHldArchiveMagic)) return fail();
+    if (!write_varint(buf, kHldArchiveVersion) || !write_varint(buf, n)) return fail();
+    for (int k = 0; k < n; ++k) {
+        if (!write_varint(buf, zigzag_encode((int64_t)order[k] - (k ? order[k - 1] : -1)))) return fail();
+    }
+    for (int k = 1; k < n; ++k) {
+        if (!write_varint(buf, k - hld.get_pos(hld.get_parent(order[k])))) return fail();
+    }
+    for (int k = 0; k < n; ++k) {
+        if (!write_varint(buf, zigzag_encode(hld.get_node_value(order[k])))) return fail();
+    }
+    return true;
+}
+
+/**
+ * @brief Reads an archive written by write_hld_archive.
+ * @return The rebuilt HLD, or nullptr if the stream is truncated or malformed.
+ *
+ * @note Time complexity: O(N + archive bytes).
+ */
+inline unique_ptr<HLD> read_hld_archive(istream& in) {
+    HLD_TRACE_SCOPE("read_hld_archive");
+    streambuf& buf = *in.rdbuf();
+    char magic[sizeof(kHldArchiveMagic)];
+    if (buf.sgetn(magic, sizeof(magic)) != (streamsize)sizeof(magic) ||
+        !equal(magic, magic + sizeof(magic), kHldArchiveMagic)) {
+        return nullptr;
+    }
+    uint64_t version, n;
+    if (!read_varint(buf, version) || version != kHldArchiveVersion) return nullptr;
+    if (!read_varint(buf, n) || n == 0 || n > (uint64_t)numeric_limits<int>::max()) return nullptr;
+
+    vector<int> order(n);
+    int64_t previous = -1;
+    for (uint64_t k = 0; k < n; ++k) {
+        uint64_t code;
+        if (!read_varint(buf, code)) return nullptr;
+        previous += zigzag_decode(code);
+        if (previous < 0 || previous >= (int64_t)n) return nullptr;
+        order[k] = (int)previous;
+    }
+
+    vector<int> parent_of(n);
+    parent_of[order[0]] = -1;
+    for (uint64_t k = 1; k < n; ++k) {
+        uint64_t distance;
+        if (!read_varint(buf, distance) || distance == 0 || distance > k) return nullptr;
+        parent_of[order[k]] = order[k - distance];
+    }
+
+    vector<int> values(n);
+    for (uint64_t k = 0; k < n; ++k) {
+        uint64_t code;
+        if (!read_varint(buf, code)) return nullptr;
+        int64_t value = zigzag_decode(code);
+        if (value < numeric_limits<int>::min() || value > numeric_limits<int>::max()) return nullptr;
+        values[order[k]] = (int)value;
+    }
+
+    unique_ptr<HLD> hld(new HLD((int)n, values));
+    if (!hld->build_from_preorder(order, parent_of)) return nullptr;
+    return hld;
+}
+
+// --- Import from nested-set (lft/rgt) encoded hierarchies ---
+struct NestedSetRow {
+    int id;
+    int lft;
+    int rgt;
+    int value;
+};
+
+/**
+ * @brief Builds an HLD from nested-set rows, as stored by SQL hierarchies: ids are 0..N-1 and the 2N lft/rgt
+ *        bounds are exactly 1..2N, with every node's interval enclosing those of its descendants. Rows may come
+ *        in any order. A bucket pass by lft yields the SQL preorder; a stack over it yields parents and depths,
+ *        and (rgt - lft + 1) / 2 is the subtree size. Heavy children (first largest child in lft order, as in
+ *        build) then fix the heavy-first `pos` in one more scan, and build_from_preorder finishes the job, so no
+ *        adjacency lists or DFS are involved.
+ * @return The built HLD, or nullptr if the rows are not a valid nested-set encoding of one tree.
+ *
+ * @note Time complexity: O(N).
+ */
+inline unique_ptr<HLD> build_hld_from_nested_sets(const vector<NestedSetRow>& rows) {
+    HLD_TRACE_SCOPE("build_hld_from_nested_sets");
+    const int n = (int)rows.size();
+    if (n == 0) return nullptr;
+    vector<int> by_lft(2 * n + 1, -1); // Row index of the node whose interval starts at each bound
+    vector<char> bound_used(2 * n + 1, 0);
+    vector<char> id_used(n, 0);
+    for (int i = 0; i < n; ++i) {
+        const NestedSetRow& row = rows[i];
+        if (row.id < 0 || row.id >= n || id_used[row.id]) return nullptr;
+        if (row.lft < 1 || row.rgt > 2 * n || row.lft >= row.rgt) return nullptr;
+        if (bound_used[row.lft] || bound_used[row.rgt]) return nullptr;
+        id_used[row.id] = bound_used[row.lft] = bound_used[row.rgt] = 1;
+        by_lft[row.lft] = i;
+    }
+
+    // Preorder by lft; the enclosing interval still open on the stack is the parent.
+    vector<int> parent_of(n, -1), heavy(n, -1), size(n), lft_order;
+    lft_order.reserve(n);
+    vector<int> stack;
+    for (int b = 1; b <= 2 * n; ++b) {
+        if (by_lft[b] == -1) continue;
+        const NestedSetRow& row = rows[by_lft[b]];
+        while (!stack.empty() && rows[stack.back()].rgt < row.lft) stack.pop_back();
+        if (stack.empty() != lft_order.empty()) return nullptr; // A second root
+        if (!stack.empty()) {
+            const NestedSetRow& up = rows[stack.back()];
+            if (row.rgt > up.rgt) return nullptr; // Overlapping, not nested
+            parent_of[row.id] = up.id;
+        }
+        size[row.id] = (row.rgt - row.lft + 1) / 2;
+        stack.push_back(by_lft[b]);
+        lft_order.push_back(row.id);
+    }
+    for (int k = 1; k < n; ++k) {
+        int u = lft_order[k], p = parent_of[u];
+        if (heavy[p] == -1 || size[u] > size[heavy[p]]) heavy[p] = u;
+    }
+
+    // Heavy child right after its parent, light children after the heavy subtree in lft order.
+    vector<int> pos(n), next_slot(n), order(n, -1);
+    for (int u : lft_order) {
+        int p = parent_of[u];
+        if (p == -1) {
+            pos[u] = 0;
+        } else if (u == heavy[p]) {
+            pos[u] = pos[p] + 1;
+        } else {
+            pos[u] = next_slot[p];
+            next_slot[p] += size[u];
+        }
+        next_slot[u] = pos[u] + 1 + (heavy[u] == -1 ? 0 : size[heavy[u]]);
+        if (pos[u] >= n || order[pos[u]] != -1) return nullptr;
+        order[pos[u]] = u;
+    }
+
+    vector<int> values(n);
+    for (const NestedSetRow& row : rows) values[row.id] = row.value;
+    unique_ptr<HLD> hld(new HLD(n, values));
+    if (!hld->build_from_preorder(order, parent_of)) return nullptr;
+    return hld;
+}
+
+// --- C ABI (see hld_c_api.h) ---
+struct hld_handle {
+    HLD hld;
+    int num_nodes;
+    size_t num_edges;
+    bool built;
+
+    hld_handle(int n, const vector<int>& values) : hld(n, values), num_nodes(n), num_edges(0), built(false) {}
+};
+
+/**
+ * @brief Checks that every id in a flat array lies in [0, num_nodes).
+ *        For interleaved (node, value) arrays pass stride 2 to skip the values.
+ */
+static bool hld_ids_in_range(const int* ids, size_t count, size_t stride, int num_nodes) {
+    for (size_t i = 0; i < count; i += stride) {
+        if (ids[i] < 0 || ids[i] >= num_nodes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern "C" {
+
+hld_handle* hld_create(int num_nodes, const int* initial_values) {
+    if (num_nodes <= 0 || initial_values == nullptr) {
+        return nullptr;
+    }
+    try {
+        return new hld_handle(num_nodes, vector<int>(initial_values, initial_values + num_nodes));
+    } catch (const bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void hld_destroy(hld_handle* handle) {
+    delete handle;
+}
+
+int hld_add_edges(hld_handle* handle, const int* edges, size_t num_edges) {
+    if (handle == nullptr || (edges == nullptr && num_edges > 0)) return HLD_ERR_INVALID_ARGUMENT;
+    if (handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(edges, 2 * num_edges, 1, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    try {
+        for (size_t i = 0; i < num_edges; ++i) {
+            handle->hld.add_edge(edges[2 * i], edges[2 * i + 1]);
+            ++handle->num_edges;
+        }
+    } catch (const bad_alloc&) {
+        return HLD_ERR_OUT_OF_MEMORY;
+    }
+    return HLD_OK;
+}
+
+int hld_build(hld_handle* handle, int root) {
+    if (handle == nullptr || root < 0 || root >= handle->num_nodes) return HLD_ERR_INVALID_ARGUMENT;
+    if (handle->built) return HLD_ERR_BAD_STATE;
+    if (handle->num_edges != (size_t)handle->num_nodes - 1) return HLD_ERR_INVALID_ARGUMENT;
+    try {
+        if (!handle->hld.build(root)) return HLD_ERR_INVALID_ARGUMENT;
+    } catch (const bad_alloc&) {
+        return HLD_ERR_OUT_OF_MEMORY;
+    }
+    handle->built = true;
+    return HLD_OK;
+}
+
+int hld_query_path_batch(hld_handle* handle, const int* pairs, size_t num_pairs, int* results) {
+    if (handle == nullptr || (num_pairs > 0 && (pairs == nullptr || results == nullptr))) return HLD_ERR_INVALID_ARGUMENT;
+    if (!handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(pairs, 2 * num_pairs, 1, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    handle->hld.query_path_batch(pairs, num_pairs, results);
+    return HLD_OK;
+}
+
+int hld_get_lca_batch(hld_handle* handle, const int* pairs, size_t num_pairs, int* results) {
+    if (handle == nullptr || (num_pairs > 0 && (pairs == nullptr || results == nullptr))) return HLD_ERR_INVALID_ARGUMENT;
+    if (!handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(pairs, 2 * num_pairs, 1, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    handle->hld.get_lca_batch(pairs, num_pairs, results);
+    return HLD_OK;
+}
+
+int hld_lca_of_set(hld_handle* handle, const int* nodes, size_t num_nodes, int* result) {
+    if (handle == nullptr || nodes == nullptr || num_nodes == 0 || result == nullptr) return HLD_ERR_INVALID_ARGUMENT;
+    if (!handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(nodes, num_nodes, 1, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    *result = handle->hld.lca_of_set(nodes, num_nodes);
+    return HLD_OK;
+}
+
+int hld_is_ancestor_batch(hld_handle* handle, const int* pairs, size_t num_pairs, unsigned char* results) {
+    if (handle == nullptr || (num_pairs > 0 && (pairs == nullptr || results == nullptr))) return HLD_ERR_INVALID_ARGUMENT;
+    if (!handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(pairs, 2 * num_pairs, 1, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    handle->hld.is_ancestor_batch(pairs, num_pairs, results);
+    return HLD_OK;
+}
+
+int hld_update_batch(hld_handle* handle, const int* updates, size_t num_updates) {
+    if (handle == nullptr || (updates == nullptr && num_updates > 0)) return HLD_ERR_INVALID_ARGUMENT;
+    if (!handle->built) return HLD_ERR_BAD_STATE;
+    if (!hld_ids_in_range(updates, 2 * num_updates, 2, handle->num_nodes)) return HLD_ERR_INVALID_ARGUMENT;
+    handle->hld.update_node_values_batch(updates, num_updates);
+    return HLD_OK;
+}
+
+} // extern "C"
+
+// Tests, the sample and main() are left out of library builds.
+#ifndef HLD_NO_MAIN
+void test_single_node_tree() {
+    cout << "Running test_single_node_tree..." << endl;
+    vector<int> node_values = {100};
+    HLD hld_solver(1, node_values);
+    hld_solver.build(0);
+
+    assert(hld_solver.query_path(0, 0) == 100);
+    assert(hld_solver.get_lca(0, 0) == 0);
+
+    hld_solver.update_node_value(0, 50);
+    assert(hld_solver.query_path(0, 0) == 50);
+    cout << "test_single_node_tree PASSED" << endl;
+}
+
+void test_line_graph() {
+    cout << "Running test_line_graph..." << endl;
+    int n = 4;
+    vector<int> node_values = {10, 20, 30, 40};
+    HLD hld_solver(n, node_values);
+    hld_solver.add_edge(0, 1);
+    hld_solver.add_edge(1, 2);
+    hld_solver.add_edge(2, 3);
+    hld_solver.build(0);
+
+    assert(hld_solver.query_path(0, 0) == 10);
+    assert(hld_solver.query_path(1, 1) == 20);
+    assert(hld_solver.query_path(0, 1) == 10 + 20);
+    assert(hld_solver.query_path(1, 0) == 10 + 20);
+    assert(hld_solver.query_path(0, 3) == 10 + 20 + 30 + 40);
+    assert(hld_solver.query_path(3, 0) == 10 + 20 + 30 + 40);
+    assert(hld_solver.query_path(1, 2) == 20 + 30);
+    assert(hld_solver.query_path(2, 3) == 30 + 40);
+
+    assert(hld_solver.get_lca(0, 0) == 0);
+    assert(hld_solver.get_lca(0, 3) == 0);
+    assert(hld_solver.get_lca(1, 3) == 1);
+    assert(hld_solver.get_lca(2, 3) == 2);
+    assert(hld_solver.get_lca(3, 1) == 1);
+
+    hld_solver.update_node_value(1, 200);
+    assert(hld_solver.query_path(0, 0) == 10);
+    assert(hld_solver.query_path(1, 1) == 200);
+    assert(hld_solver.query_path(0, 1) == 10 + 200);
+    assert(hld_solver.query_path(0, 3) == 10 + 200 + 30 + 40);
+    cout << "test_line_graph PASSED" << endl;
+}
+
+void test_star_graph() {
+    cout << "Running test_star_graph..." << endl;
+    int n = 4;
+    vector<int> node_values = {100, 10, 20, 30};
+    HLD hld_solver(n, node_values);
+    hld_solver.add_edge(0, 1);
+    hld_solver.add_edge(0, 2);
+    hld_solver.add_edge(0, 3);
+    hld_solver.build(0);
+
+    assert(hld_solver.query_path(0, 0) == 100);
+    assert(hld_solver.query_path(1, 1) == 10);
+    assert(hld_solver.query_path(0, 1) == 100 + 10);
+    assert(hld_solver.query_path(1, 2) == 10 + 100 + 20);
+    assert(hld_solver.query_path(2, 1) == 10 + 100 + 20);
+    assert(hld_solver.query_path(1, 3) == 10 + 100 + 30);
+
+    assert(hld_solver.get_lca(0, 1) == 0);
+    assert(hld_solver.get_lca(1, 2) == 0);
+    assert(hld_solver.get_lca(1, 0) == 0);
+    assert(hld_solver.get_lca(3, 2) == 0);
+
+    hld_solver.update_node_value(0, 5);
+    assert(hld_solver.query_path(0, 1) == 5 + 10);
+    assert(hld_solver.query_path(1, 2) == 10 + 5 + 20);
+
+    hld_solver.update_node_value(2, 200);
+    assert(hld_solver.query_path(1, 2) == 10 + 5 + 200);
+    assert(hld_solver.query_path(0, 2) == 5 + 200);
+    cout << "test_star_graph PASSED" << endl;
+}
+
+void test_original_example_tree() {
+    cout << "Running test_original_example_tree..." << endl;
+    int n = 7;
+    vector<int> node_values = {2, 10, 5, 3, 8, 1, 7};
+    HLD hld_solver(n, node_values);
+    hld_solver.add_edge(1, 0);
+    hld_solver.add_edge(1, 2);
+    hld_solver.add_edge(1, 3);
+    hld_solver.add_edge(0, 4);
+    hld_solver.add_edge(3, 5);
+    hld_solver.add_edge(5, 6);
+    hld_solver.build(1);
+
+    assert(hld_solver.query_path(4, 6) == (8 + 2 + 10 + 3 + 1 + 7));
+    assert(hld_solver.query_path(6, 4) == (8 + 2 + 10 + 3 + 1 + 7));
+    assert(hld_solver.query_path(0, 2) == (2 + 10 + 5));
+    assert(hld_solver.query_path(1, 1) == 10);
+    assert(hld_solver.query_path(6, 6) == 7);
+    assert(hld_solver.query_path(1, 6) == (10 + 3 + 1 + 7));
+
+    assert(hld_solver.get_lca(4, 6) == 1);
+    assert(hld_solver.get_lca(4, 0) == 0);
+    assert(hld_solver.get_lca(2, 5) == 1);
+    assert(hld_solver.get_lca(6, 3) == 3);
+    assert(hld_solver.get_lca(4, 2) == 1);
+
+    hld_solver.update_node_value(1, 100);
+    assert(hld_solver.query_path(4, 6) == (8 + 2 + 100 + 3 + 1 + 7));
+    assert(hld_solver.query_path(0, 2) == (2 + 100 + 5));
+    
+    hld_solver.update_node_value(6, 70);
+    assert(hld_solver.query_path(4, 6) == (8 + 2 + 100 + 3 + 1 + 70));
+    cout << "test_original_example_tree PASSED" << endl;
+}
+
+void test_batch_queries() {
+    cout << "Running test_batch_queries..." << endl;
+    int n = 7;
+    vector<int> node_values = {2, 10, 5, 3, 8, 1, 7};
+    HLD hld_solver(n, node_values);
+    hld_solver.add_edge(1, 0);
+    hld_solver.add_edge(1, 2);
+    hld_solver.add_edge(1, 3);
+    hld_solver.add_edge(0, 4);
+    hld_solver.add_edge(3, 5);
+    hld_solver.add_edge(5, 6);
+    hld_solver.build(1);
+
+    // More pairs than one lockstep group, so the group boundary is exercised.
+    vector<int> pairs;
+    for (int u = 0; u < n; ++u) {
+        for (int v = 0; v < n; ++v) {
+            pairs.push_back(u);
+            pairs.push_back(v);
+        }
+    }
+    size_t count = pairs.size() / 2;
+    vector<int> sums(count), lcas(count);
+    hld_solver.query_path_batch(pairs.data(), count, sums.data());
+    hld_solver.get_lca_batch(pairs.data(), count, lcas.data());
+    for (size_t i = 0; i < count; ++i) {
+        assert(sums[i] == hld_solver.query_path(pairs[2 * i], pairs[2 * i + 1]));
+        assert(lcas[i] == hld_solver.get_lca(pairs[2 * i], pairs[2 * i + 1]));
+    }
+
+    vector<int> updates = {1, 100, 6, 70, 1, 50};
+    hld_solver.update_node_values_batch(updates.data(), updates.size() / 2);
+    assert(hld_solver.query_path(4, 6) == (8 + 2 + 50 + 3 + 1 + 70));
+    cout << "test_batch_queries PASSED" << endl;
+}
+
+void test_c_api_batch() {
+    cout << "Running test_c_api_batch..." << endl;
+    int values[] = {2, 10, 5, 3, 8, 1, 7};
+    hld_handle* handle = hld_create(7, values);
+    assert(handle != nullptr);
+
+    int pairs[] = {4, 6, 0, 2};
+    int results[2];
+    int status = hld_query_path_batch(handle, pairs, 2, results);
+    assert(status == HLD_ERR_BAD_STATE);
+
+    int edges[] = {1, 0, 1, 2, 1, 3, 0, 4, 3, 5, 5, 6};
+    status = hld_add_edges(handle, edges, 6);
+    assert(status == HLD_OK);
+    status = hld_build(handle, 1);
+    assert(status == HLD_OK);
+    status = hld_add_edges(handle, edges, 1);
+    assert(status == HLD_ERR_BAD_STATE);
+
+    status = hld_query_path_batch(handle, pairs, 2, results);
+    assert(status == HLD_OK);
+    assert(results[0] == (8 + 2 + 10 + 3 + 1 + 7));
+    assert(results[1] == (2 + 10 + 5));
+    status = hld_get_lca_batch(handle, pairs, 2, results);
+    assert(status == HLD_OK);
+    assert(results[0] == 1 && results[1] == 1);
+
+    int set[] = {6, 5, 3};
+    status = hld_lca_of_set(handle, set, 3, results);
+    assert(status == HLD_OK);
+    assert(results[0] == 3);
+    int ancestor_pairs[] = {3, 6, 6, 3, 1, 4};
+    unsigned char flags[3];
+    status = hld_is_ancestor_batch(handle, ancestor_pairs, 3, flags);
+    assert(status == HLD_OK);
+    assert(flags[0] == 1 && flags[1] == 0 && flags[2] == 1);
+
+    int bad_updates[] = {1, 100, 7, 5};
+    status = hld_update_batch(handle, bad_updates, 2);
+    assert(status == HLD_ERR_INVALID_ARGUMENT);
+    int updates[] = {1, 100, 6, 70};
+    status = hld_update_batch(handle, updates, 2);
+    assert(status == HLD_OK);
+    status = hld_query_path_batch(handle, pairs, 2, results);
+    assert(status == HLD_OK);
+    assert(results[0] == (8 + 2 + 100 + 3 + 1 + 70));
+
+    int bad_pairs[] = {0, -1};
+    status = hld_query_path_batch(handle, bad_pairs, 1, results);
+    assert(status == HLD_ERR_INVALID_ARGUMENT);
+    hld_destroy(handle);
+    (void)status;
+    cout << "test_c_api_batch PASSED" << endl;
+}
+
+void test_c_api_rejects_non_trees() {
+    cout << "Running test_c_api_rejects_non_trees..." << endl;
+    int values[] = {1, 2, 3, 4};
+    int pairs[] = {0, 3};
+    int result = 0;
+
+    // Each edge set has num_nodes - 1 edges but is not a tree: a 3-cycle beside an isolated node, a repeated
+    // edge and a self-loop. The build stops at the first node reached twice instead of walking the cycle.
+    int cycle[] = {0, 1, 1, 2, 2, 0};
+    int repeated[] = {0, 1, 1, 2, 0, 1};
+    int self_loop[] = {0, 1, 1, 2, 3, 3};
+    for (const int* edges : {cycle, repeated, self_loop}) {
+        hld_handle* handle = hld_create(4, values);
+        int status = hld_add_edges(handle, edges, 3);
+        assert(status == HLD_OK);
+        status = hld_build(handle, 0);
+        assert(status == HLD_ERR_INVALID_ARGUMENT);
+        status = hld_query_path_batch(handle, pairs, 1, &result);
+        assert(status == HLD_ERR_BAD_STATE);
+        hld_destroy(handle);
+        (void)status;
+    }
+
+    // Too few edges (a forest) or too many (a cycle through every node) fail the edge count before any
+    // work is done, so the missing edge can still be added.
+    hld_handle* handle = hld_create(4, values);
+    int forest[] = {0, 1, 2, 3};
+    int status = hld_add_edges(handle, forest, 2);
+    assert(status == HLD_OK);
+    status = hld_build(handle, 0);
+    assert(status == HLD_ERR_INVALID_ARGUMENT);
+    status = hld_query_path_batch(handle, pairs, 1, &result);
+    assert(status == HLD_ERR_BAD_STATE);
+    int closing[] = {1, 2, 3, 0};
+    status = hld_add_edges(handle, closing, 2);
+    assert(status == HLD_OK);
+    status = hld_build(handle, 0);
+    assert(status == HLD_ERR_INVALID_ARGUMENT);
+    hld_destroy(handle);
+
+    handle = hld_create(4, values);
+    status = hld_add_edges(handle, forest, 2);
+    assert(status == HLD_OK);
+    status = hld_add_edges(handle, closing, 1);
+    assert(status == HLD_OK);
+    status = hld_build(handle, 0);
+    assert(status == HLD_OK);
+    status = hld_query_path_batch(handle, pairs, 1, &result);
+    assert(status == HLD_OK);
+    assert(result == 1 + 2 + 3 + 4);
+    hld_destroy(handle);
+    (void)status;
+    cout << "test_c_api_rejects_non_trees PASSED" << endl;
+}
+
+// --- Randomised differential harness ---
+enum class RandomTreeShape { kUniform, kDeep, kCaterpillar };
+
+struct RandomTree {
+    int root;
+    vector<int> parent;           // parent[root] == -1
+    vector<int> depth;            // Unweighted depth from root
+    vector<pair<int, int>> edges; // Shuffled, randomly oriented
+};
+
+/**
+ * @brief Generates a random rooted tree with randomly relabelled nodes.
+ *        kUniform attaches each node to a uniformly random earlier node (depth O(log n)),
+ *        kDeep mostly extends the newest nodes (depth Θ(n)), and kCaterpillar hangs leaves off a long spine.
+ */
+RandomTree make_random_tree(int n, RandomTreeShape shape, mt19937& rng) {
+    vector<int> construction_parent(n, -1);
+    for (int i = 1; i < n; ++i) {
+        switch (shape) {
+            case RandomTreeShape::kUniform:
+                construction_parent[i] = (int)(rng() % i);
+                break;
+            case RandomTreeShape::kDeep:
+                construction_parent[i] = max(0, i - 1 - (int)(rng() % 3));
+                break;
+            case RandomTreeShape::kCaterpillar:
+                construction_parent[i] = (i <= n / 2) ? i - 1 : (int)(rng() % (n / 2));
+                break;
+        }
+    }
+
+    vector<int> label(n);
+    iota(label.begin(), label.end(), 0);
+    shuffle(label.begin(), label.end(), rng);
+
+    RandomTree tree;
+    tree.root = label[0];
+    tree.parent.assign(n, -1);
+    tree.depth.assign(n, 0);
+    for (int i = 1; i < n; ++i) {
+        int u = label[i], p = label[construction_parent[i]];
+        tree.parent[u] = p;
+        tree.depth[u] = tree.depth[p] + 1;
+        if (rng() & 1) {
+            tree.edges.push_back({u, p});
+        } else {
+            tree.edges.push_back({p, u});
+        }
+    }
+    shuffle(tree.edges.begin(), tree.edges.end(), rng);
+    return tree;
+}
+
+int brute_force_lca(const RandomTree& tree, int u, int v) {
+    while (tree.depth[u] > tree.depth[v]) u = tree.parent[u];
+    while (tree.depth[v] > tree.depth[u]) v = tree.parent[v];
+    while (u != v) {
+        u = tree.parent[u];
+        v = tree.parent[v];
+    }
+    return u;
+}
+
+int brute_force_path_sum(const RandomTree& tree, const vector<int>& values, int u, int v) {
+    int w = brute_force_lca(tree, u, v);
+    int sum = values[w];
+    for (; u != w; u = tree.parent[u]) sum += values[u];
+    for (; v != w; v = tree.parent[v]) sum += values[v];
+    return sum;
+}
+
+// Nodes on the path from u to v, in walk order (u first, v last).
+vector<int> brute_force_path_nodes(const RandomTree& tree, int u, int v) {
+    int w = brute_force_lca(tree, u, v);
+    vector<int> nodes;
+    for (; u != w; u = tree.parent[u]) nodes.push_back(u);
+    nodes.push_back(w);
+    size_t turn = nodes.size();
+    for (; v != w; v = tree.parent[v]) nodes.push_back(v);
+    reverse(nodes.begin() + turn, nodes.end());
+    return nodes;
+}
+
+// Builds an HLD over a random tree through add_edge/build, with values[u] on node u.
+HLD build_hld(const RandomTree& tree, const vector<int>& values) {
+    HLD hld_solver((int)values.size(), values);
+    for (const auto& e : tree.edges) hld_solver.add_edge(e.first, e.second);
+    hld_solver.build(tree.root);
+    return hld_solver;
+}
+
+int floor_log2(int n) {
+    int k = 0;
+    while ((2 << k) <= n) ++k;
+    return k;
+}
+
+/**
+ * @brief Cross-checks HLD against a parent-walk oracle on one random tree.
+ *        Every num_ops operation is a point update, a path query or an LCA query; queries are also
+ *        replayed through the batch and C ABI entry points. With op counters enabled, each query must
+ *        cross at most 2*floor(log2 N) light edges and visit at most 4*(ceil(log2 N)+1) segment tree
+ *        nodes per chain segment.
+ */
+void run_differential_case(int n, RandomTreeShape shape, int num_ops, unsigned seed) {
+    mt19937 rng(seed);
+    RandomTree tree = make_random_tree(n, shape, rng);
+    vector<int> values(n);
+    for (int& x : values) x = (int)(rng() % 2001) - 1000;
+
+    HLD hld_solver(n, values);
+    vector<int> flat_edges;
+    for (const auto& e : tree.edges) {
+        hld_solver.add_edge(e.first, e.second);
+        flat_edges.push_back(e.first);
+        flat_edges.push_back(e.second);
+    }
+    hld_solver.build(tree.root);
+
+    hld_handle* handle = hld_create(n, values.data());
+    int status = hld_add_edges(handle, flat_edges.data(), flat_edges.size() / 2);
+    assert(status == HLD_OK);
+    status = hld_build(handle, tree.root);
+    assert(status == HLD_OK);
+
+#ifndef HLD_DISABLE_OP_COUNTERS
+    const unsigned long long max_hops = 2ULL * floor_log2(n);
+    (void)max_hops;
+    const unsigned long long max_nodes_per_segment = 4ULL * (floor_log2(2 * n - 1) + 1);
+    (void)max_nodes_per_segment;
+#endif
+
+    vector<int> pairs, expected_sums, expected_lcas;
+    auto flush_batch = [&]() {
+        size_t count = pairs.size() / 2;
+        vector<int> sums(count), lcas(count);
+        hld_solver.query_path_batch(pairs.data(), count, sums.data());
+        hld_solver.get_lca_batch(pairs.data(), count, lcas.data());
+        assert(sums == expected_sums);
+        assert(lcas == expected_lcas);
+        status = hld_query_path_batch(handle, pairs.data(), count, sums.data());
+        assert(status == HLD_OK);
+        assert(sums == expected_sums);
+        pairs.clear();
+        expected_sums.clear();
+        expected_lcas.clear();
+    };
+
+    for (int op = 0; op < num_ops; ++op) {
+        int u = (int)(rng() % n), v = (int)(rng() % n);
+        if (op % 4 == 0) {
+            // The batch must be answered against the values it was recorded with.
+            flush_batch();
+            int new_value = (int)(rng() % 2001) - 1000;
+            values[u] = new_value;
+            hld_solver.update_node_value(u, new_value);
+            int update[] = {u, new_value};
+            status = hld_update_batch(handle, update, 1);
+            assert(status == HLD_OK);
+            continue;
+        }
+
+        int expected_lca = brute_force_lca(tree, u, v);
+        int expected_sum = brute_force_path_sum(tree, values, u, v);
+
+        hld_op_counters() = HLDOpCounters();
+        assert(hld_solver.query_path(u, v) == expected_sum);
+#ifndef HLD_DISABLE_OP_COUNTERS
+        const HLDOpCounters& ops = hld_op_counters();
+        assert(ops.chain_hops <= max_hops);
+        assert(ops.segment_nodes_visited <= (ops.chain_hops + 1) * max_nodes_per_segment);
+#endif
+        hld_op_counters() = HLDOpCounters();
+        assert(hld_solver.get_lca(u, v) == expected_lca);
+#ifndef HLD_DISABLE_OP_COUNTERS
+        assert(ops.chain_hops <= max_hops);
+        assert(ops.segment_nodes_visited == 0);
+        (void)ops;
+#endif
+
+        pairs.push_back(u);
+        pairs.push_back(v);
+        expected_sums.push_back(expected_sum);
+        expected_lcas.push_back(expected_lca);
+    }
+    flush_batch();
+    hld_destroy(handle);
+    (void)status;
+}
+
+void test_randomized_differential() {
+    cout << "Running test_randomized_differential..." << endl;
+    run_differential_case(1, RandomTreeShape::kUniform, 20, 1);
+    run_differential_case(2, RandomTreeShape::kDeep, 20, 2);
+    run_differential_case(1000000, RandomTreeShape::kUniform, 20000, 3);
+    run_differential_case(100000, RandomTreeShape::kDeep, 400, 4);
+    run_differential_case(200000, RandomTreeShape::kCaterpillar, 600, 5);
+    cout << "test_randomized_differential PASSED" << endl;
+}
+
+void test_dynamic_diameter() {
+    cout << "Running test_dynamic_diameter..." << endl;
+    mt19937 rng(104);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        for (int n : {1, 2, 3, 60}) {
+            RandomTree tree = make_random_tree(n, shape, rng);
+            HLD hld_solver = build_hld(tree, vector<int>(n, 0));
+
+            vector<long long> weight(n, 0);
+            for (int u = 0; u < n; ++u) {
+                if (u != tree.root) weight[u] = rng() % 100;
+            }
+            DynamicDiameterIndex index(hld_solver, weight);
+
+            auto distance = [&](int u, int v) {
+                long long d = 0;
+                int w = brute_force_lca(tree, u, v);
+                for (; u != w; u = tree.parent[u]) d += weight[u];
+                for (; v != w; v = tree.parent[v]) d += weight[v];
+                return d;
+            };
+
+            for (int round = 0; round < 30; ++round) {
+                long long expected_diameter = 0;
+                for (int u = 0; u < n; ++u) {
+                    long long expected_far = 0;
+                    for (int v = 0; v < n; ++v) expected_far = max(expected_far, distance(u, v));
+                    expected_diameter = max(expected_diameter, expected_far);
+                    pair<long long, int> far = index.farthest_from(u);
+                    assert(far.first == expected_far);
+                    assert(distance(u, far.second) == expected_far);
+                    (void)far;
+                }
+                assert(index.diameter() == expected_diameter);
+                pair<int, int> ends = index.diameter_endpoints();
+                assert(distance(ends.first, ends.second) == expected_diameter);
+                (void)ends;
+
+                if (n > 1) {
+                    int v = (int)(rng() % n);
+                    if (v == tree.root) continue;
+                    weight[v] = (round % 5 == 0) ? 0 : rng() % 1000;
+                    index.update_edge_weight(v, weight[v]);
+                }
+            }
+        }
+    }
+    cout << "test_dynamic_diameter PASSED" << endl;
+}
+
+void test_time_windowed_path_counts() {
+    cout << "Running test_time_windowed_path_counts..." << endl;
+    mt19937 rng(105);
+    int n = 50;
+    RandomTree tree = make_random_tree(n, RandomTreeShape::kUniform, rng);
+    vector<int> baseline(n);
+    for (int& x : baseline) x = (int)(rng() % 5);
+    HLD hld_solver = build_hld(tree, baseline);
+
+    const long long window = 20;
+    TimeWindowedHLD windowed(hld_solver, window);
+    struct Event { long long timestamp; int node; int count; };
+    vector<Event> history;
+
+    long long now = 0;
+    for (int op = 0; op < 3000; ++op) {
+        now += rng() % 3; // Several events may share a timestamp.
+        if (rng() % 2) {
+            Event e = {now, (int)(rng() % n), (int)(rng() % 10) + 1};
+            history.push_back(e);
+            windowed.add_event(e.node, e.count, e.timestamp);
+            continue;
+        }
+        int u = (int)(rng() % n), v = (int)(rng() % n);
+        vector<int> live = baseline;
+        for (const Event& e : history) {
+            if (e.timestamp > now - window) live[e.node] += e.count;
+        }
+        assert(windowed.query_path(u, v, now) == brute_force_path_sum(tree, live, u, v));
+        (void)u;
+        (void)v;
+    }
+
+    // Jumping past the window expires everything, leaving only the baseline.
+    now += window;
+    assert(windowed.query_path(tree.root, tree.root, now) == baseline[tree.root]);
+    assert(windowed.live_events() == 0);
+    cout << "test_time_windowed_path_counts PASSED" << endl;
+}
+
+void test_path_labels() {
+    cout << "Running test_path_labels..." << endl;
+    mt19937 tree_rng(106);
+    mt19937_64 rng(106);
+    int n = 300;
+    RandomTree tree = make_random_tree(n, RandomTreeShape::kDeep, tree_rng);
+    vector<uint64_t> labels(n);
+    for (uint64_t& x : labels) x = rng() & rng() & rng(); // Sparse masks so intersections are not always empty.
+    HLD hld_solver = build_hld(tree, vector<int>(n, 0));
+    PathLabelIndex index(hld_solver, labels);
+
+    vector<int> pairs;
+    vector<uint64_t> expected_any;
+    for (int op = 0; op < 2000; ++op) {
+        int u = (int)(rng() % n), v = (int)(rng() % n);
+        if (op % 3 == 0) {
+            labels[u] = rng() & rng();
+            index.set_node_labels(u, labels[u]);
+            pairs.clear();
+            expected_any.clear();
+            continue;
+        }
+        uint64_t any = 0, all = ~0ULL;
+        for (int x : brute_force_path_nodes(tree, u, v)) {
+            any |= labels[x];
+            all &= labels[x];
+        }
+
+        assert(index.path_labels(u, v) == any);
+        assert(index.path_common_labels(u, v) == all);
+        int t = (int)(rng() % 64);
+        assert(index.path_has_label(u, v, t) == (((any >> t) & 1) != 0));
+        (void)t;
+
+        pairs.push_back(u);
+        pairs.push_back(v);
+        expected_any.push_back(any);
+        if (op % 3 == 2) {
+            vector<uint64_t> batch(expected_any.size());
+            index.path_labels_batch(pairs.data(), batch.size(), batch.data());
+            assert(batch == expected_any);
+        }
+    }
+    cout << "test_path_labels PASSED" << endl;
+}
+
+void test_lca_of_set_and_ancestor_batch() {
+    cout << "Running test_lca_of_set_and_ancestor_batch..." << endl;
+    mt19937 rng(107);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        int n = 2000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        HLD hld_solver = build_hld(tree, vector<int>(n, 0));
+
+        for (int round = 0; round < 200; ++round) {
+            int set_size = 1 + (int)(rng() % (round < 100 ? 4 : 500));
+            vector<int> nodes(set_size);
+            for (int& x : nodes) x = (int)(rng() % n);
+            int expected = nodes[0];
+            for (int x : nodes) expected = brute_force_lca(tree, expected, x);
+            assert(hld_solver.lca_of_set(nodes) == expected);
+        }
+
+        vector<int> pairs;
+        for (int i = 0; i < 5000; ++i) {
+            int v = (int)(rng() % n);
+            // Half the pairs use a true ancestor of v so both outcomes are exercised.
+            int u = v;
+            if (i % 2 == 0) {
+                for (int steps = (int)(rng() % 20); steps > 0 && tree.parent[u] != -1; --steps) u = tree.parent[u];
+            } else {
+                u = (int)(rng() % n);
+            }
+            pairs.push_back(u);
+            pairs.push_back(v);
+        }
+        vector<uint8_t> results(pairs.size() / 2);
+        hld_solver.is_ancestor_batch(pairs.data(), results.size(), results.data());
+        for (size_t i = 0; i < results.size(); ++i) {
+            int u = pairs[2 * i], v = pairs[2 * i + 1];
+            bool expected = brute_force_lca(tree, u, v) == u;
+            assert(hld_solver.is_ancestor(u, v) == expected);
+            assert((results[i] == 1) == expected);
+            (void)expected;
+        }
+    }
+    cout << "test_lca_of_set_and_ancestor_batch PASSED" << endl;
+}
+
+/**
+ * @brief Counts the distinct trace tracks (thread ids) holding at least one span named span_name.
+ */
+int count_trace_threads(const string& span_name) {
+    ostringstream json;
+    TraceRecorder::instance().write_chrome_trace(json);
+    const string text = json.str();
+    const string name_key = "{\"name\":\"" + span_name + "\"";
+    vector<int> thread_ids;
+    for (size_t at = text.find(name_key); at != string::npos; at = text.find(name_key, at + 1)) {
+        size_t tid_at = text.find("\"tid\":", at) + 6;
+        thread_ids.push_back(atoi(text.c_str() + tid_at));
+    }
+    sort(thread_ids.begin(), thread_ids.end());
+    return (int)(unique(thread_ids.begin(), thread_ids.end()) - thread_ids.begin());
+}
+
+void test_chrome_trace_output() {
+    cout << "Running test_chrome_trace_output..." << endl;
+    TraceRecorder& recorder = TraceRecorder::instance();
+    recorder.clear();
+    {
+        TraceScope outer("outer \"phase\"");
+        TraceScope inner("inner");
+    }
+    assert(recorder.size() == 2);
+
+    HLD hld_solver(3, {1, 2, 3});
+    hld_solver.add_edge(0, 1);
+    hld_solver.add_edge(1, 2);
+    hld_solver.build(0);
+#ifdef HLD_ENABLE_TRACING
+    assert(recorder.size() == 2 + 6 + 3); // HLD::build, its five phases and one span per adjacency merge step
+#else
+    assert(recorder.size() == 2);
+#endif
+
+    ostringstream json;
+    recorder.write_chrome_trace(json);
+    string text = json.str();
+    assert(text.find("{\"traceEvents\":[") == 0);
+    assert(text.find("\"name\":\"outer \\\"phase\\\"\"") != string::npos);
+    assert(text.find("\"ph\":\"X\"") != string::npos);
+#ifdef HLD_ENABLE_TRACING
+    assert(text.find("\"name\":\"build_adjacency\"") != string::npos);
+    assert(text.find("\"name\":\"dfs1_size_depth_parent\"") != string::npos);
+    assert(text.find("\"name\":\"segment_tree_build\"") != string::npos);
+#endif
+    recorder.clear();
+    cout << "test_chrome_trace_output PASSED" << endl;
+}
+
+void test_prometheus_metrics() {
+    cout << "Running test_prometheus_metrics..." << endl;
+    MetricsRegistry registry;
+    ShardedCounter& requests = registry.counter("test_requests_total", "Requests.");
+    LatencyHistogram& latency = registry.histogram("test_latency_seconds", "Latency.");
 
-    SegmentTree seg_tree; // Segment tree to store values on flattened heavy paths
+    vector<thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.emplace_back([&]() {
+            for (int i = 0; i < 1000; ++i) {
+                requests.add();
+                latency.observe_ns(i % 2 ? 300 : 20000000); // 300ns or 20ms
+            }
+        });
+    }
+    for (thread& worker : workers) worker.join();
+    assert(&registry.counter("test_requests_total", "Requests.") == &requests);
+    assert(requests.value() == 4000);
 
-    /**
-     * @brief First DFS pass to calculate subtree sizes, depths, and parents,
-     *        and identify the heavy child for each node.
-     *
-     * @param u The current node being visited.
-     * @param p The parent of the current node.
-     * @param d The depth of the current node from the root.
-     */
-    void dfs1_size_depth_parent(int u, int p, int d) {
-        parent[u] = p;
-        depth[u] = d;
-        subtree_size[u] = 1;
-        int max_c_subtree_size = 0;
+    HLD hld_solver(3, {1, 2, 3});
+    hld_solver.add_edge(0, 1);
+    hld_solver.add_edge(0, 2);
+    hld_solver.build(0);
+    assert(hld_solver.num_chains() == 2);
+    export_hld_gauges(registry, hld_solver);
+
+    string text = registry.render_prometheus();
+    assert(text.find("# TYPE test_requests_total counter\ntest_requests_total 4000\n") != string::npos);
+    assert(text.find("# TYPE test_latency_seconds histogram\n") != string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"2.5e-07\"} 0\n") != string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"5e-07\"} 2000\n") != string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"0.01\"} 2000\n") != string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"0.05\"} 4000\n") != string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"+Inf\"} 4000\n") != string::npos);
+    assert(text.find("test_latency_seconds_count 4000\n") != string::npos);
+    assert(text.find("hld_nodes 3\n") != string::npos);
+    assert(text.find("hld_chains 2\n") != string::npos);
+    assert(text.find("hld_memory_bytes ") != string::npos);
+    cout << "test_prometheus_metrics PASSED" << endl;
+}
+
+void test_compressed_archive() {
+    cout << "Running test_compressed_archive..." << endl;
+    // Accepts at most `capacity` bytes and refuses the rest, like a full disk.
+    struct FixedCapacityBuf : streambuf {
+        vector<char> storage;
+        explicit FixedCapacityBuf(size_t capacity) : storage(capacity) {
+            setp(storage.data(), storage.data() + capacity);
+        }
+        size_t written() const { return pptr() - pbase(); }
+    };
+    mt19937 rng(110);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        for (int n : {1, 2, 5000}) {
+            RandomTree tree = make_random_tree(n, shape, rng);
+            vector<int> values(n);
+            for (int& x : values) x = (int)(rng() % 2001) - 1000;
+            HLD original = build_hld(tree, values);
+            original.update_node_value(tree.root, -123456); // Archives current values
+            values[tree.root] = -123456;
+
+            ostringstream out;
+            bool written = write_hld_archive(original, out);
+            assert(written && out.good());
+            (void)written;
+            string bytes = out.str();
+            // Raw edge list plus values would be 12 bytes per node; randomly relabelled ids dominate what remains.
+            assert(n < 100 || bytes.size() < (size_t)n * 12 / 2);
 
-        for (int v : adj[u]) {
-            if (v == p) continue;
-            dfs1_size_depth_parent(v, u, d + 1);
-            subtree_size[u] += subtree_size[v];
-            if (subtree_size[v] > max_c_subtree_size) {
-                max_c_subtree_size = subtree_size[v];
-                heavy_child[u] = v;
+            istringstream in(bytes);
+            unique_ptr<HLD> restored = read_hld_archive(in);
+            assert(restored != nullptr);
+            assert(restored->size() == n);
+            for (int u = 0; u < n; ++u) {
+                assert(restored->get_pos(u) == original.get_pos(u));
+                assert(restored->get_parent(u) == original.get_parent(u));
+                assert(restored->get_depth(u) == original.get_depth(u));
+                assert(restored->get_subtree_size(u) == original.get_subtree_size(u));
+                assert(restored->get_node_value(u) == values[u]);
+            }
+            assert(restored->num_chains() == original.num_chains());
+            for (int i = 0; i < 200; ++i) {
+                int u = (int)(rng() % n), v = (int)(rng() % n);
+                assert(restored->get_lca(u, v) == original.get_lca(u, v));
+                assert(restored->query_path(u, v) == original.query_path(u, v));
+                (void)u;
+                (void)v;
+            }
+
+            // Every strict prefix is truncated and must be rejected.
+            for (size_t cut = 0; cut < bytes.size(); cut += 1 + bytes.size() / 50) {
+                istringstream truncated(bytes.substr(0, cut));
+                assert(read_hld_archive(truncated) == nullptr);
+            }
+
+            // A short write is reported and marks the stream bad; an exact fit succeeds.
+            for (size_t capacity : {(size_t)0, bytes.size() / 2, bytes.size() - 1, bytes.size()}) {
+                FixedCapacityBuf limited(capacity);
+                ostream limited_out(&limited);
+                bool fits = write_hld_archive(original, limited_out);
+                assert(fits == (capacity == bytes.size()) && limited_out.bad() == !fits);
+                assert(string(limited.storage.data(), limited.written()) == bytes.substr(0, limited.written()));
+                (void)fits;
             }
         }
     }
 
-    /**
-     * @brief Second DFS pass to perform Heavy-Light Decomposition.
-     *        Assigns chain heads and positions in the flattened array.
-     *
-     * @param u The current node being visited.
-     * @param h The head of the heavy path the current node belongs to.
-     */
-    void dfs2_hld(int u, int h) {
-        head[u] = h;
-        pos[u] = cur_pos++;
+    // Values at the ends of the int range survive the zig-zag varint encoding.
+    stringbuf varints;
+    const int64_t extremes[] = {numeric_limits<int>::min(), -1, 0, 1, numeric_limits<int>::max()};
+    for (int64_t x : extremes) {
+        bool ok = write_varint(varints, zigzag_encode(x));
+        assert(ok);
+        (void)ok;
+    }
+    for (int64_t x : extremes) {
+        uint64_t encoded = 0;
+        bool ok = read_varint(varints, encoded);
+        assert(ok && zigzag_decode(encoded) == x);
+        (void)ok;
+        (void)x;
+    }
+    assert(zigzag_encode(numeric_limits<int>::min()) == 0xFFFFFFFFULL);
+
+    // A parent stream that is not a heavy-first preorder is rejected: node 1 (heavy child of 0) has size 1,
+    // while its later sibling 2 has a child.
+    HLD hld_solver(4, {0, 0, 0, 0});
+    assert(!hld_solver.build_from_preorder({0, 1, 2, 3}, {-1, 0, 0, 2}));
+    cout << "test_compressed_archive PASSED" << endl;
+}
+
+void test_online_ancestor_index() {
+    cout << "Running test_online_ancestor_index..." << endl;
+    mt19937 rng(111);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        int n = 3000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        HLD hld_solver = build_hld(tree, vector<int>(n, 0));
 
-        if (heavy_child[u] != -1) {
-            dfs2_hld(heavy_child[u], h);
+        OnlineAncestorIndex index(hld_solver);
+        // Append leaves below both old and freshly appended nodes, extending the brute-force tree alongside.
+        for (int i = 0; i < 3000; ++i) {
+            int p = (i % 3 == 0) ? (int)(rng() % index.size()) : index.size() - 1;
+            int v = index.add_leaf(p);
+            assert(v == (int)tree.parent.size());
+            (void)v;
+            tree.parent.push_back(p);
+            tree.depth.push_back(tree.depth[p] + 1);
         }
 
-        for (int v : adj[u]) {
-            if (v == parent[u] || v == heavy_child[u]) continue;
-            dfs2_hld(v, v);
+        int total = index.size();
+        for (int i = 0; i < 3000; ++i) {
+            int u = (int)(rng() % total), v = (int)(rng() % total);
+            assert(index.get_depth(u) == tree.depth[u]);
+            assert(index.get_lca(u, v) == brute_force_lca(tree, u, v));
+            (void)v;
+            int k = (int)(rng() % (tree.depth[u] + 2));
+            int expected = u;
+            for (int step = 0; step < k && expected != -1; ++step) expected = tree.parent[expected];
+            assert(index.kth_ancestor(u, k) == expected);
         }
     }
-};
+    cout << "test_online_ancestor_index PASSED" << endl;
+}
 
-void test_single_node_tree() {
-    cout << "Running test_single_node_tree..." << endl;
-    vector<int> node_values = {100};
-    HLD hld_solver(1, node_values);
-    hld_solver.build(0);
+void test_subtree_order_statistics() {
+    cout << "Running test_subtree_order_statistics..." << endl;
+    mt19937 rng(112);
 
-    assert(hld_solver.query_path(0, 0) == 100);
-    assert(hld_solver.get_lca(0, 0) == 0);
+    // The bit vector under the wavelet matrix: rank everywhere, select on every set bit, across sparse and
+    // dense stretches and word and sample boundaries, plus the empty vector.
+    for (size_t num_bits : {0, 1, 64, 65, 5000}) {
+        RankBitVector bits(num_bits);
+        vector<size_t> ones;
+        for (size_t i = 0; i < num_bits; ++i) {
+            if ((i < num_bits / 2) ? (rng() % 7 == 0) : (rng() % 7 != 0)) {
+                bits.set(i);
+                ones.push_back(i);
+            }
+        }
+        bits.build_rank();
+        bits.build_select();
+        size_t seen = 0;
+        for (size_t i = 0; i <= num_bits; ++i) {
+            assert(bits.rank1(i) == seen && bits.rank0(i) == i - seen);
+            if (i < num_bits && bits.get(i)) ++seen;
+        }
+        for (size_t k = 0; k < ones.size(); ++k) assert(bits.select1(k) == ones[k]);
+    }
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        for (int n : {1, 2, 700}) {
+            for (int value_range : {1, 5, 1000000}) {
+                RandomTree tree = make_random_tree(n, shape, rng);
+                vector<int> values(n);
+                for (int& x : values) x = (int)(rng() % value_range) - value_range / 2;
+                HLD hld_solver = build_hld(tree, values);
+                SubtreeOrderStatistics index(hld_solver);
 
-    hld_solver.update_node_value(0, 50);
-    assert(hld_solver.query_path(0, 0) == 50);
-    cout << "test_single_node_tree PASSED" << endl;
+                for (int i = 0; i < 100; ++i) {
+                    int u = (int)(rng() % n);
+                    vector<int> subtree_values;
+                    for (int v = 0; v < n; ++v) {
+                        if (brute_force_lca(tree, u, v) == u) subtree_values.push_back(values[v]);
+                    }
+                    sort(subtree_values.begin(), subtree_values.end());
+                    assert((int)subtree_values.size() == hld_solver.get_subtree_size(u));
+
+                    int k = (int)(rng() % subtree_values.size());
+                    assert(index.subtree_kth(u, k) == subtree_values[k]);
+                    (void)k;
+
+                    int x = (i % 2) ? subtree_values[rng() % subtree_values.size()]
+                                    : (int)(rng() % (value_range + 2)) - value_range / 2 - 1;
+                    int expected = (int)(upper_bound(subtree_values.begin(), subtree_values.end(), x) -
+                                         subtree_values.begin());
+                    assert(index.subtree_count_le(u, x) == expected);
+                    (void)expected;
+                }
+            }
+        }
+    }
+    cout << "test_subtree_order_statistics PASSED" << endl;
 }
 
-void test_line_graph() {
-    cout << "Running test_line_graph..." << endl;
-    int n = 4;
-    vector<int> node_values = {10, 20, 30, 40};
-    HLD hld_solver(n, node_values);
-    hld_solver.add_edge(0, 1);
-    hld_solver.add_edge(1, 2);
-    hld_solver.add_edge(2, 3);
-    hld_solver.build(0);
+void test_shared_subtree_decomposition() {
+    cout << "Running test_shared_subtree_decomposition..." << endl;
+    mt19937 rng(113);
+    // A random backbone with copies of a few random templates hung off it, as in per-region org charts.
+    for (int template_size : {1, 12, 60}) {
+        RandomTree backbone = make_random_tree(50, RandomTreeShape::kUniform, rng);
+        vector<RandomTree> templates;
+        for (int t = 0; t < 3; ++t) {
+            templates.push_back(make_random_tree(template_size + t, RandomTreeShape::kUniform, rng));
+        }
 
-    assert(hld_solver.query_path(0, 0) == 10);
-    assert(hld_solver.query_path(1, 1) == 20);
-    assert(hld_solver.query_path(0, 1) == 10 + 20);
-    assert(hld_solver.query_path(1, 0) == 10 + 20);
-    assert(hld_solver.query_path(0, 3) == 10 + 20 + 30 + 40);
-    assert(hld_solver.query_path(3, 0) == 10 + 20 + 30 + 40);
-    assert(hld_solver.query_path(1, 2) == 20 + 30);
-    assert(hld_solver.query_path(2, 3) == 30 + 40);
+        vector<int> parent_of = backbone.parent;
+        for (int copy = 0; copy < 300; ++copy) {
+            const RandomTree& t = templates[copy % templates.size()];
+            int base = (int)parent_of.size();
+            for (int u = 0; u < (int)t.parent.size(); ++u) {
+                parent_of.push_back(t.parent[u] == -1 ? (int)(rng() % 50) : base + t.parent[u]);
+            }
+        }
+        int n = (int)parent_of.size();
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 201) - 100;
 
-    assert(hld_solver.get_lca(0, 0) == 0);
-    assert(hld_solver.get_lca(0, 3) == 0);
-    assert(hld_solver.get_lca(1, 3) == 1);
-    assert(hld_solver.get_lca(2, 3) == 2);
-    assert(hld_solver.get_lca(3, 1) == 1);
+        RandomTree tree;
+        tree.root = backbone.root;
+        tree.parent = parent_of;
+        tree.depth.assign(n, -1);
+        HLD hld_solver(n, values);
+        for (int u = 0; u < n; ++u) {
+            if (parent_of[u] != -1) hld_solver.add_edge(parent_of[u], u);
+        }
+        hld_solver.build(tree.root);
+        for (int u = 0; u < n; ++u) tree.depth[u] = hld_solver.get_depth(u);
 
-    hld_solver.update_node_value(1, 200);
-    assert(hld_solver.query_path(0, 0) == 10);
-    assert(hld_solver.query_path(1, 1) == 200);
-    assert(hld_solver.query_path(0, 1) == 10 + 200);
-    assert(hld_solver.query_path(0, 3) == 10 + 200 + 30 + 40);
-    cout << "test_line_graph PASSED" << endl;
+        SharedSubtreeDecomposition shared(parent_of, values);
+        if (template_size >= SharedSubtreeDecomposition::kMinSharedSize) {
+            // Backbone nodes carrying identical copies can themselves repeat, so a few copies merge into larger instances.
+            assert(shared.num_instances() >= 250 && shared.num_templates() * 10 < shared.num_instances());
+            assert(shared.memory_bytes() * 4 < hld_solver.memory_bytes());
+        }
+
+        for (int u = 0; u < n; ++u) {
+            int p = shared.position_of(u);
+            assert(shared.get_depth(p) == tree.depth[u]);
+            assert(shared.get_subtree_size(p) == hld_solver.get_subtree_size(u));
+            assert(shared.get_parent(p) == (parent_of[u] == -1 ? -1 : shared.position_of(parent_of[u])));
+            (void)p;
+        }
+        for (int i = 0; i < 3000; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            if (i % 5 == 0) {
+                values[u] = (int)(rng() % 201) - 100;
+                hld_solver.update_node_value(u, values[u]);
+                shared.update_value(shared.position_of(u), values[u]);
+            }
+            int p = shared.position_of(u), q = shared.position_of(v);
+            assert(shared.get_lca(p, q) == shared.position_of(brute_force_lca(tree, u, v)));
+            assert(shared.query_path(p, q) == hld_solver.query_path(u, v));
+            (void)p;
+            (void)q;
+        }
+    }
+    cout << "test_shared_subtree_decomposition PASSED" << endl;
 }
 
-void test_star_graph() {
-    cout << "Running test_star_graph..." << endl;
-    int n = 4;
-    vector<int> node_values = {100, 10, 20, 30};
-    HLD hld_solver(n, node_values);
-    hld_solver.add_edge(0, 1);
-    hld_solver.add_edge(0, 2);
-    hld_solver.add_edge(0, 3);
-    hld_solver.build(0);
+void test_forkable_hld() {
+    cout << "Running test_forkable_hld..." << endl;
+    mt19937 rng(114);
+    for (int n : {1, 63, 64, 65, 3000}) {
+        RandomTree tree = make_random_tree(n, RandomTreeShape::kUniform, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 201) - 100;
+        auto base_hld = make_shared<HLD>(build_hld(tree, values));
 
-    assert(hld_solver.query_path(0, 0) == 100);
-    assert(hld_solver.query_path(1, 1) == 10);
-    assert(hld_solver.query_path(0, 1) == 100 + 10);
-    assert(hld_solver.query_path(1, 2) == 10 + 100 + 20);
-    assert(hld_solver.query_path(2, 1) == 10 + 100 + 20);
-    assert(hld_solver.query_path(1, 3) == 10 + 100 + 30);
+        ForkableHLD base(base_hld);
+        vector<ForkableHLD> forks;
+        vector<vector<int>> fork_values;
+        for (int f = 0; f < 40; ++f) {
+            // Fork either the base or an earlier fork, then apply a few hypothetical updates.
+            bool from_base = forks.empty() || f % 2 == 0;
+            int source = from_base ? -1 : (int)(rng() % forks.size());
+            forks.push_back(from_base ? base.fork() : forks[source].fork());
+            fork_values.push_back(from_base ? values : fork_values[source]);
+            for (int k = 0; k < 5; ++k) {
+                int u = (int)(rng() % n), value = (int)(rng() % 201) - 100;
+                forks.back().update_node_value(u, value);
+                fork_values.back()[u] = value;
+            }
+        }
 
-    assert(hld_solver.get_lca(0, 1) == 0);
-    assert(hld_solver.get_lca(1, 2) == 0);
-    assert(hld_solver.get_lca(1, 0) == 0);
-    assert(hld_solver.get_lca(3, 2) == 0);
+        for (int i = 0; i < 300; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            assert(base.query_path(u, v) == brute_force_path_sum(tree, values, u, v));
+            assert(base.get_node_value(u) == values[u]);
+            int f = (int)(rng() % forks.size());
+            assert(forks[f].query_path(u, v) == brute_force_path_sum(tree, fork_values[f], u, v));
+            assert(forks[f].get_node_value(v) == fork_values[f][v]);
+            (void)u;
+            (void)v;
+            (void)f;
+        }
+    }
+    cout << "test_forkable_hld PASSED" << endl;
+}
 
-    hld_solver.update_node_value(0, 5);
-    assert(hld_solver.query_path(0, 1) == 5 + 10);
-    assert(hld_solver.query_path(1, 2) == 10 + 5 + 20);
+void test_offline_path_max() {
+    cout << "Running test_offline_path_max..." << endl;
+    mt19937 rng(115);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        for (int n : {1, 2, 2000}) {
+            RandomTree tree = make_random_tree(n, shape, rng);
+            HLD hld_solver = build_hld(tree, vector<int>(n, 0));
+            vector<int> weight(n, 0);
+            for (int& w : weight) w = (int)(rng() % 50) - 10; // Many ties
 
-    hld_solver.update_node_value(2, 200);
-    assert(hld_solver.query_path(1, 2) == 10 + 5 + 200);
-    assert(hld_solver.query_path(0, 2) == 5 + 200);
-    cout << "test_star_graph PASSED" << endl;
+            vector<int> edges;
+            vector<int> pairs;
+            for (int i = 0; i < 2000; ++i) {
+                int u = (int)(rng() % n), v = (int)(rng() % n), w = (int)(rng() % 50) - 10;
+                edges.insert(edges.end(), {u, v, w});
+                pairs.insert(pairs.end(), {u, v});
+            }
+            vector<int> maxima(pairs.size() / 2);
+            path_max_edge_batch(hld_solver, weight, pairs.data(), maxima.size(), maxima.data());
+            vector<uint8_t> exceeds(maxima.size());
+            non_tree_edges_exceed_path_max(hld_solver, weight, edges.data(), exceeds.size(), exceeds.data());
+
+            for (size_t i = 0; i < maxima.size(); ++i) {
+                int u = pairs[2 * i], v = pairs[2 * i + 1];
+                int w = brute_force_lca(tree, u, v);
+                int expected = numeric_limits<int>::min();
+                for (; u != w; u = tree.parent[u]) expected = max(expected, weight[u]);
+                for (; v != w; v = tree.parent[v]) expected = max(expected, weight[v]);
+                assert(maxima[i] == expected);
+                assert((exceeds[i] == 1) == (edges[3 * i + 2] > expected));
+            }
+        }
+    }
+    cout << "test_offline_path_max PASSED" << endl;
 }
 
-void test_original_example_tree() {
-    cout << "Running test_original_example_tree..." << endl;
-    int n = 7;
+void test_auto_tuner() {
+    cout << "Running test_auto_tuner..." << endl;
+    mt19937 rng(116);
+    int n = 20000;
+    RandomTree tree = make_random_tree(n, RandomTreeShape::kUniform, rng);
+    vector<int> values(n);
+    for (int& x : values) x = (int)(rng() % 100);
+    HLD hld_solver = build_hld(tree, values);
+
+    HLDWorkloadSample sample;
+    for (int i = 0; i < 2000; ++i) {
+        sample.path_pairs.push_back((int)(rng() % n));
+        sample.path_pairs.push_back((int)(rng() % n));
+        if (i % 2 == 0) {
+            sample.lca_pairs.push_back((int)(rng() % n));
+            sample.lca_pairs.push_back((int)(rng() % n));
+        }
+        if (i % 4 == 0) {
+            sample.updates.push_back((int)(rng() % n));
+            sample.updates.push_back((int)(rng() % 100));
+        }
+    }
+
+    // Every width must give the same answers.
+    size_t count = sample.path_pairs.size() / 2;
+    vector<int> expected(count), got(count);
+    hld_solver.query_path_batch(sample.path_pairs.data(), count, expected.data());
+    for (int width : {1, 3, 32, 100}) {
+        hld_solver.set_batch_width(width);
+        hld_solver.query_path_batch(sample.path_pairs.data(), count, got.data());
+        assert(got == expected);
+    }
+    assert(hld_solver.get_batch_width() == HLD::kMaxBatchWidth);
+    hld_solver.set_batch_width(HLD::kDefaultBatchWidth);
+
+    string path = (filesystem::temp_directory_path() / ("hld_tuning_test_" + to_string(rng()) + ".txt")).string();
+    remove(path.c_str());
+    HLDTuning first = HLDAutoTuner::tune(hld_solver, sample, path, chrono::milliseconds(20));
+    assert(hld_solver.get_batch_width() == first.batch_width);
+    (void)first;
+    // Calibration replays the sampled updates but leaves the tree as it found it.
+    for (int u = 0; u < n; ++u) assert(hld_solver.get_node_value(u) == values[u]);
+
+    // A second start reuses the cached choice instead of measuring again.
+    HLDAutoTuner::save({5}, n, path);
+    HLDTuning cached = HLDAutoTuner::tune(hld_solver, sample, path, chrono::milliseconds(20));
+    assert(cached.batch_width == 5 && hld_solver.get_batch_width() == 5);
+    (void)cached;
+    HLDTuning loaded;
+    bool ok = HLDAutoTuner::load(path, 3 * n, loaded);
+    assert(!ok); // Tuned for a very different tree size
+    remove(path.c_str());
+    ok = HLDAutoTuner::load(path, n, loaded);
+    assert(!ok);
+    (void)ok;
+    hld_solver.set_batch_width(HLD::kDefaultBatchWidth);
+    cout << "test_auto_tuner PASSED" << endl;
+}
+
+void test_mixed_batch_executor() {
+    cout << "Running test_mixed_batch_executor..." << endl;
+    mt19937 rng(117);
+    for (int num_threads : {1, 4}) {
+        for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kCaterpillar}) {
+            int n = 5000;
+            RandomTree tree = make_random_tree(n, shape, rng);
+            vector<int> values(n);
+            for (int& x : values) x = (int)(rng() % 201) - 100;
+            HLD batched = build_hld(tree, values);
+            HLD sequential = batched;
+
+            for (int round = 0; round < 3; ++round) {
+                vector<MixedBatchExecutor::Operation> ops;
+                for (int i = 0; i < 8000; ++i) {
+                    // Few hot nodes for updates so many queries depend on several updates to the same node.
+                    if (rng() % 3 == 0) {
+                        int node = (rng() % 2) ? (int)(rng() % 20) : (int)(rng() % n);
+                        ops.push_back(MixedBatchExecutor::Operation::update(node, (int)(rng() % 201) - 100));
+                    } else {
+                        ops.push_back(MixedBatchExecutor::Operation::query((int)(rng() % n), (int)(rng() % n)));
+                    }
+                }
+
+                vector<int> results;
+                MixedBatchExecutor::execute(batched, ops, results, num_threads);
+                for (size_t i = 0; i < ops.size(); ++i) {
+                    if (ops[i].is_update) {
+                        sequential.update_node_value(ops[i].a, ops[i].b);
+                    } else {
+                        assert(results[i] == sequential.query_path(ops[i].a, ops[i].b));
+                    }
+                }
+                for (int u = 0; u < n; ++u) {
+                    assert(batched.get_node_value(u) == sequential.get_node_value(u));
+                }
+            }
+        }
+    }
+
+    // One long chain: every query spans it and most updates come after most queries' positions in the stream.
+    int n = 20000;
+    vector<int> values(n);
+    for (int& x : values) x = (int)(rng() % 201) - 100;
+    HLD batched(n, values);
+    for (int u = 1; u < n; ++u) batched.add_edge(u - 1, u);
+    batched.build(0);
+    HLD sequential = batched;
+    vector<MixedBatchExecutor::Operation> ops;
+    for (int i = 0; i < 20000; ++i) {
+        if (i % 2 == 0) {
+            ops.push_back(MixedBatchExecutor::Operation::update((int)(rng() % n), (int)(rng() % 201) - 100));
+        } else {
+            ops.push_back(MixedBatchExecutor::Operation::query((int)(rng() % 10), n - 1 - (int)(rng() % 10)));
+        }
+    }
+    vector<int> results;
+    TraceRecorder::instance().clear();
+    MixedBatchExecutor::execute(batched, ops, results, 4);
+#ifdef HLD_ENABLE_TRACING
+    // 10000 queries are enough for all four workers, and each records a span on its own track.
+    int worker_tracks = count_trace_threads("MixedBatchExecutor.worker");
+    assert(worker_tracks == 4);
+    (void)worker_tracks;
+#endif
+    TraceRecorder::instance().clear();
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (ops[i].is_update) {
+            sequential.update_node_value(ops[i].a, ops[i].b);
+        } else {
+            assert(results[i] == sequential.query_path(ops[i].a, ops[i].b));
+        }
+    }
+    cout << "test_mixed_batch_executor PASSED" << endl;
+}
+
+void test_path_topk() {
+    cout << "Running test_path_topk..." << endl;
+    mt19937 rng(118);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep}) {
+        int n = 1500;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 50) - 25; // Many ties
+        HLD hld_solver = build_hld(tree, values);
+        PathTopKIndex<32> index(hld_solver);
+        PathTopKIndex<4> small_index(hld_solver);
+        // The extremes go only into the indexes; the HLD's sum tree would overflow on them.
+        values[0] = numeric_limits<int>::min();
+        values[1] = numeric_limits<int>::max();
+        for (int u : {0, 1}) {
+            index.update_node_value(u, values[u]);
+            small_index.update_node_value(u, values[u]);
+        }
+
+        for (int i = 0; i < 2000; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            if (i % 4 == 0) {
+                values[u] = (int)(rng() % 50) - 25;
+                index.update_node_value(u, values[u]);
+                small_index.update_node_value(u, values[u]);
+            }
+            vector<pair<int, int>> expected; // (value, node), largest first
+            for (int x : brute_force_path_nodes(tree, u, v)) expected.push_back({values[x], x});
+            sort(expected.rbegin(), expected.rend());
+
+            int k = 1 + (int)(rng() % 32);
+            int nodes[32], top_values[32];
+            int written = index.query_path_topk(u, v, k, nodes, top_values);
+            assert(written == min(k, (int)expected.size()));
+            for (int j = 0; j < written; ++j) {
+                assert(nodes[j] == expected[j].second && top_values[j] == expected[j].first);
+            }
+
+            int small_k = min(k, 4);
+            written = small_index.query_path_topk(u, v, small_k, nodes);
+            assert(written == min(small_k, (int)expected.size()));
+            for (int j = 0; j < written; ++j) assert(nodes[j] == expected[j].second);
+        }
+    }
+    cout << "test_path_topk PASSED" << endl;
+}
+
+void test_path_distinct() {
+    cout << "Running test_path_distinct..." << endl;
+    mt19937 rng(119);
+    int n = 4000;
+    RandomTree tree = make_random_tree(n, RandomTreeShape::kDeep, rng);
+    vector<int> values(n);
+    for (int& x : values) x = (int)(rng() % 3000);
+    HLD hld_solver = build_hld(tree, values);
+    PathDistinctIndex<10> index(hld_solver);
+
+    // Exact for tiny sets, where linear counting on 1024 registers is nearly collision-free.
+    int leaf = 0;
+    while (hld_solver.get_subtree_size(leaf) != 1) ++leaf;
+    assert(index.query_path_distinct(leaf, leaf) > 0.99 && index.query_path_distinct(leaf, leaf) < 1.01);
+
+    double total_error = 0;
+    int checked = 0;
+    for (int i = 0; i < 300; ++i) {
+        int u = (int)(rng() % n), v = (int)(rng() % n);
+        if (i % 3 == 0) {
+            values[u] = (int)(rng() % 3000);
+            index.update_node_value(u, values[u]);
+        }
+        vector<int> on_path;
+        for (int x : brute_force_path_nodes(tree, u, v)) on_path.push_back(values[x]);
+        sort(on_path.begin(), on_path.end());
+        double exact = (double)(unique(on_path.begin(), on_path.end()) - on_path.begin());
+        double estimate = index.query_path_distinct(u, v);
+        double error = fabs(estimate - exact) / exact;
+        assert(error < 0.2); // More than 6 standard errors for 1024 registers.
+        total_error += error;
+        ++checked;
+    }
+    assert(total_error / checked < 0.05);
+    cout << "test_path_distinct PASSED" << endl;
+}
+
+void test_path_quantile() {
+    cout << "Running test_path_quantile..." << endl;
+    mt19937 rng(120);
+    int n = 4000;
+    RandomTree tree = make_random_tree(n, RandomTreeShape::kDeep, rng);
+    vector<int> values(n);
+    for (int& x : values) x = (int)(rng() % 100000);
+    HLD hld_solver = build_hld(tree, values);
+    PathQuantileIndex<64> index(hld_solver);
+
+    assert(index.query_path_quantile(7, 7, 0.5) == values[7]);
+    const double qs[] = {0.0, 0.01, 0.25, 0.5, 0.9, 0.99, 1.0};
+    for (int i = 0; i < 300; ++i) {
+        int u = (int)(rng() % n), v = (int)(rng() % n);
+        if (i % 3 == 0) {
+            values[u] = (int)(rng() % 100000);
+            index.update_node_value(u, values[u]);
+        }
+        vector<int> on_path;
+        for (int x : brute_force_path_nodes(tree, u, v)) on_path.push_back(values[x]);
+        sort(on_path.begin(), on_path.end());
+        double m = (double)on_path.size();
+        for (double q : qs) {
+            double estimate = index.query_path_quantile(u, v, q);
+            assert(estimate >= on_path.front() && estimate <= on_path.back());
+            // The estimate's rank range among the exact values must be close to q.
+            double below = (double)(lower_bound(on_path.begin(), on_path.end(), estimate) - on_path.begin()) / m;
+            double at_or_below = (double)(upper_bound(on_path.begin(), on_path.end(), estimate) - on_path.begin()) / m;
+            double tolerance = 0.03 + 1.0 / m;
+            assert(below <= q + tolerance && at_or_below >= q - tolerance);
+            (void)below;
+            (void)at_or_below;
+            (void)tolerance;
+        }
+        assert(index.query_path_quantile(u, v, 0.0) == on_path.front());
+        assert(index.query_path_quantile(u, v, 1.0) == on_path.back());
+    }
+    cout << "test_path_quantile PASSED" << endl;
+}
+
+void test_concurrent_edge_ingestion() {
+    cout << "Running test_concurrent_edge_ingestion..." << endl;
+    mt19937 rng(121);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kCaterpillar}) {
+        int n = 300000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 1000);
+
+        // A few edges through add_edge, the rest from loader threads each owning a slice of the edge file.
+        const int num_loaders = 4;
+        const size_t direct = 100;
+        HLD ingested(n, values);
+        for (size_t i = 0; i < direct; ++i) ingested.add_edge(tree.edges[i].first, tree.edges[i].second);
+        EdgeIngestor ingestor(num_loaders);
+        vector<thread> loaders;
+        for (int t = 0; t < num_loaders; ++t) {
+            loaders.emplace_back([&, t]() {
+                size_t begin = direct + (tree.edges.size() - direct) * t / num_loaders;
+                size_t end = direct + (tree.edges.size() - direct) * (t + 1) / num_loaders;
+                for (size_t i = begin; i < end; ++i) ingestor.add_edge(t, tree.edges[i].first, tree.edges[i].second);
+            });
+        }
+        for (thread& t : loaders) t.join();
+        ingested.ingest(ingestor);
+        TraceRecorder::instance().clear();
+        ingested.build(tree.root);
+#ifdef HLD_ENABLE_TRACING
+        // 300000 edges are enough for up to four merge workers; each gets its own track.
+        int worker_tracks = count_trace_threads("build_adjacency.worker");
+        assert(thread::hardware_concurrency() > 1 ? worker_tracks > 1 : worker_tracks == 1);
+        (void)worker_tracks;
+#endif
+        TraceRecorder::instance().clear();
+
+        // Same edges in the same order through add_edge must give the identical decomposition.
+        HLD sequential = build_hld(tree, values);
+
+        assert(ingested.num_chains() == sequential.num_chains());
+        for (int u = 0; u < n; ++u) {
+            assert(ingested.get_pos(u) == sequential.get_pos(u));
+            assert(ingested.get_parent(u) == tree.parent[u] && ingested.get_depth(u) == tree.depth[u]);
+        }
+        for (int i = 0; i < 200; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            assert(ingested.query_path(u, v) == sequential.query_path(u, v));
+            (void)u;
+            (void)v;
+        }
+    }
+    cout << "test_concurrent_edge_ingestion PASSED" << endl;
+}
+
+void test_build_from_nested_sets() {
+    cout << "Running test_build_from_nested_sets..." << endl;
+    mt19937 rng(122);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        int n = 3000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 1000) - 500;
+
+        // Number the tree like a SQL nested-set table, visiting children in a random order.
+        vector<vector<int>> children(n);
+        for (int u = 0; u < n; ++u) {
+            if (u != tree.root) children[tree.parent[u]].push_back(u);
+        }
+        for (auto& c : children) shuffle(c.begin(), c.end(), rng);
+        vector<NestedSetRow> rows(n);
+        int counter = 0;
+        vector<pair<int, int>> stack = {{tree.root, 0}}; // (node, next child index)
+        rows[tree.root] = {tree.root, ++counter, 0, values[tree.root]};
+        while (!stack.empty()) {
+            int u = stack.back().first;
+            int& next = stack.back().second;
+            if (next < (int)children[u].size()) {
+                int c = children[u][next++];
+                rows[c] = {c, ++counter, 0, values[c]};
+                stack.push_back({c, 0});
+            } else {
+                rows[u].rgt = ++counter;
+                stack.pop_back();
+            }
+        }
+        shuffle(rows.begin(), rows.end(), rng);
+
+        unique_ptr<HLD> hld = build_hld_from_nested_sets(rows);
+        assert(hld != nullptr);
+        for (int u = 0; u < n; ++u) {
+            assert(hld->get_parent(u) == tree.parent[u] && hld->get_depth(u) == tree.depth[u]);
+        }
+        for (int u = 0; u < n; ++u) {
+            // Heavy-first: the child at pos + 1 is a largest child.
+            int heavy = -1, largest = 0;
+            for (int c : children[u]) {
+                if (hld->get_pos(c) == hld->get_pos(u) + 1) heavy = c;
+                largest = max(largest, hld->get_subtree_size(c));
+            }
+            assert(children[u].empty() || (heavy != -1 && hld->get_subtree_size(heavy) == largest));
+            (void)heavy;
+        }
+        for (int i = 0; i < 300; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            assert(hld->query_path(u, v) == brute_force_path_sum(tree, values, u, v));
+            assert(hld->get_lca(u, v) == brute_force_lca(tree, u, v));
+            (void)u;
+            (void)v;
+        }
+    }
+
+    // Malformed tables.
+    assert(build_hld_from_nested_sets({}) == nullptr);
+    assert(build_hld_from_nested_sets({{0, 1, 4, 0}, {1, 2, 3, 0}}) != nullptr);
+    assert(build_hld_from_nested_sets({{0, 1, 4, 0}, {0, 2, 3, 0}}) == nullptr); // Duplicate id
+    assert(build_hld_from_nested_sets({{0, 1, 2, 0}, {1, 3, 4, 0}}) == nullptr); // Two roots
+    assert(build_hld_from_nested_sets({{0, 1, 4, 0}, {1, 2, 5, 0}}) == nullptr); // Out of range
+    assert(build_hld_from_nested_sets({{0, 1, 5, 0}, {1, 2, 6, 0}, {2, 3, 4, 0}}) == nullptr); // Overlap
+    assert(build_hld_from_nested_sets({{0, 1, 3, 0}, {1, 2, 3, 0}}) == nullptr); // Shared bound
+    cout << "test_build_from_nested_sets PASSED" << endl;
+}
+
+void test_succinct_tree() {
+    cout << "Running test_succinct_tree..." << endl;
+    mt19937 rng(123);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        int n = 20000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 1000) - 300;
+        HLD hld_solver = build_hld(tree, values);
+        SuccinctTree succinct = SuccinctTree::from_hld(hld_solver);
+        vector<int> node_at(n);
+        for (int u = 0; u < n; ++u) node_at[hld_solver.get_pos(u)] = u;
+
+        assert(succinct.size() == n);
+        for (int u = 0; u < n; ++u) {
+            int k = hld_solver.get_pos(u);
+            assert(succinct.get_node_value(k) == values[u]);
+            assert(succinct.get_depth(k) == tree.depth[u]);
+            assert(succinct.get_subtree_size(k) == hld_solver.get_subtree_size(u));
+            int p = succinct.get_parent(k);
+            assert(p == (tree.parent[u] == -1 ? -1 : hld_solver.get_pos(tree.parent[u])));
+            (void)p;
+        }
+        for (int i = 0; i < 3000; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            int a = hld_solver.get_pos(u), b = hld_solver.get_pos(v);
+            assert(node_at[succinct.get_lca(a, b)] == brute_force_lca(tree, u, v));
+            assert(succinct.is_ancestor(a, b) == hld_solver.is_ancestor(u, v));
+            (void)b;
+
+            int d = (int)(rng() % (tree.depth[u] + 2));
+            int expected = u;
+            for (int j = 0; j < d && expected != -1; ++j) expected = tree.parent[expected];
+            int got = succinct.kth_ancestor(a, d);
+            assert(got == (expected == -1 ? -1 : hld_solver.get_pos(expected)));
+            (void)got;
+        }
+
+        // 2n parentheses, rank, select samples and the min tree stay within a few bits per node, plus
+        // 10 bits per value for a range of 1000.
+        assert(succinct.memory_bytes() * 8 < (size_t)n * (4 + 10) + 8 * 1024);
+    }
+
+    // Values spanning the whole int range.
+    SuccinctTree extremes({-1, 0, 0}, {numeric_limits<int>::min(), 0, numeric_limits<int>::max()});
+    assert(extremes.get_node_value(0) == numeric_limits<int>::min());
+    assert(extremes.get_node_value(2) == numeric_limits<int>::max());
+    assert(extremes.get_lca(1, 2) == 0 && extremes.kth_ancestor(2, 1) == 0 && extremes.kth_ancestor(2, 2) == -1);
+    cout << "test_succinct_tree PASSED" << endl;
+}
+
+void test_level_subtree_index() {
+    cout << "Running test_level_subtree_index..." << endl;
+    mt19937 rng(124);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep, RandomTreeShape::kCaterpillar}) {
+        int n = 2000;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        for (int& x : values) x = (int)(rng() % 100) - 50;
+        HLD hld_solver = build_hld(tree, values);
+        LevelSubtreeIndex index(hld_solver);
+
+        for (int i = 0; i < 500; ++i) {
+            int u = (int)(rng() % n);
+            if (i % 3 == 0) {
+                int x = (int)(rng() % n);
+                values[x] = (int)(rng() % 100) - 50;
+                index.update_node_value(x, values[x]);
+            }
+            int d = (int)(rng() % 12), d_hi = d + (int)(rng() % 5);
+            int count = 0, sum = 0, range_sum = 0;
+            for (int w = 0; w < n; ++w) {
+                int below = tree.depth[w] - tree.depth[u];
+                if (below < 0) continue;
+                int x = w;
+                for (int j = 0; j < below; ++j) x = tree.parent[x];
+                if (x != u) continue;
+                if (below == d) { ++count; sum += values[w]; }
+                if (d <= below && below <= d_hi) range_sum += values[w];
+            }
+            assert(index.count_at_depth(u, d) == count);
+            assert(index.sum_at_depth(u, d) == sum);
+            assert(index.sum_depth_range(u, d, d_hi) == range_sum);
+        }
+        assert(index.count_at_depth(tree.root, 0) == 1 && index.count_at_depth(tree.root, n) == 0);
+    }
+    cout << "test_level_subtree_index PASSED" << endl;
+}
+
+void test_path_xor_basis() {
+    cout << "Running test_path_xor_basis..." << endl;
+    mt19937 rng(125);
+    for (RandomTreeShape shape : {RandomTreeShape::kUniform, RandomTreeShape::kDeep}) {
+        int n = 1500;
+        RandomTree tree = make_random_tree(n, shape, rng);
+        vector<int> values(n);
+        // Few bits per value so paths often contain dependent values; node 0 exercises the sign bit.
+        for (int& x : values) x = (int)(rng() % 4096);
+        values[0] = -1;
+        HLD hld_solver = build_hld(tree, values);
+        PathXorBasisIndex<32> index(hld_solver);
+        PathXorPrefixBasis<32> prefix(hld_solver);
+
+        for (int i = 0; i < 1000; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            // Brute force: span of the path values by elimination over a plain list.
+            vector<uint64_t> span;
+            for (int x : brute_force_path_nodes(tree, u, v)) {
+                uint64_t y = (uint32_t)values[x];
+                for (uint64_t b : span) y = min(y, y ^ b);
+                if (y) {
+                    span.push_back(y);
+                    sort(span.rbegin(), span.rend());
+                }
+            }
+            uint64_t expected = 0;
+            for (uint64_t b : span) expected = max(expected, expected ^ b);
+
+            assert(index.query_path_max_xor(u, v) == expected);
+            assert(prefix.query_path_max_xor(u, v) == expected);
+        }
+
+        // The segment tree variant supports updates; rebuild the static one to compare.
+        for (int i = 0; i < 200; ++i) {
+            int u = (int)(rng() % n);
+            values[u] = (int)(rng() % 4096);
+            index.update_node_value(u, values[u]);
+            hld_solver.update_node_value(u, values[u]);
+        }
+        PathXorPrefixBasis<32> rebuilt(hld_solver);
+        for (int i = 0; i < 300; ++i) {
+            int u = (int)(rng() % n), v = (int)(rng() % n);
+            assert(index.query_path_max_xor(u, v) == rebuilt.query_path_max_xor(u, v));
+            (void)u;
+            (void)v;
+        }
+    }
+    cout << "test_path_xor_basis PASSED" << endl;
+}
+
+#ifdef HLD_HAS_COROUTINES
+// Minimal eagerly-started coroutine type for exercising query_path_async.
+struct DetachedTestTask {
+    struct promise_type {
+        DetachedTestTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+DetachedTestTask sum_of_two_paths_async(HLD& hld, int a, int b, int c, int d, int& out) {
+    int first = co_await hld.query_path_async(a, b);
+    int second = co_await hld.query_path_async(c, d);
+    out = first + second;
+}
+
+void test_query_path_async() {
+    cout << "Running test_query_path_async..." << endl;
     vector<int> node_values = {2, 10, 5, 3, 8, 1, 7};
-    HLD hld_solver(n, node_values);
+    HLD hld_solver(7, node_values);
     hld_solver.add_edge(1, 0);
     hld_solver.add_edge(1, 2);
     hld_solver.add_edge(1, 3);
@@ -408,27 +5593,33 @@ void test_original_example_tree() {
     hld_solver.add_edge(5, 6);
     hld_solver.build(1);
 
-    assert(hld_solver.query_path(4, 6) == (8 + 2 + 10 + 3 + 1 + 7));
-    assert(hld_solver.query_path(6, 4) == (8 + 2 + 10 + 3 + 1 + 7));
-    assert(hld_solver.query_path(0, 2) == (2 + 10 + 5));
-    assert(hld_solver.query_path(1, 1) == 10);
-    assert(hld_solver.query_path(6, 6) == 7);
-    assert(hld_solver.query_path(1, 6) == (10 + 3 + 1 + 7));
+    vector<int> line_values = {10, 20, 30, 40};
+    HLD line_solver(4, line_values);
+    line_solver.add_edge(0, 1);
+    line_solver.add_edge(1, 2);
+    line_solver.add_edge(2, 3);
+    line_solver.build(0);
 
-    assert(hld_solver.get_lca(4, 6) == 1);
-    assert(hld_solver.get_lca(4, 0) == 0);
-    assert(hld_solver.get_lca(2, 5) == 1);
-    assert(hld_solver.get_lca(6, 3) == 3);
-    assert(hld_solver.get_lca(4, 2) == 1);
+    PathQueryBatcher& batcher = PathQueryBatcher::local();
+    int out1 = -1, out2 = -1, out3 = -1;
+    sum_of_two_paths_async(hld_solver, 4, 6, 0, 2, out1);
+    sum_of_two_paths_async(line_solver, 0, 3, 1, 2, out2);
+    sum_of_two_paths_async(hld_solver, 1, 1, 6, 6, out3);
 
-    hld_solver.update_node_value(1, 100);
-    assert(hld_solver.query_path(4, 6) == (8 + 2 + 100 + 3 + 1 + 7));
-    assert(hld_solver.query_path(0, 2) == (2 + 100 + 5));
-    
-    hld_solver.update_node_value(6, 70);
-    assert(hld_solver.query_path(4, 6) == (8 + 2 + 100 + 3 + 1 + 70));
-    cout << "test_original_example_tree PASSED" << endl;
+    // Nothing runs until the batcher is flushed.
+    assert(batcher.pending() == 3);
+    assert(out1 == -1 && out2 == -1 && out3 == -1);
+
+    size_t answered = batcher.flush();
+    assert(answered == 6);
+    (void)answered;
+    assert(batcher.pending() == 0);
+    assert(out1 == (8 + 2 + 10 + 3 + 1 + 7) + (2 + 10 + 5));
+    assert(out2 == (10 + 20 + 30 + 40) + (20 + 30));
+    assert(out3 == 10 + 7);
+    cout << "test_query_path_async PASSED" << endl;
 }
+#endif // HLD_HAS_COROUTINES
 
 void run_all_hld_tests() {
     cout << "--- Starting HLD Tests ---" << endl;
@@ -436,6 +5627,35 @@ void run_all_hld_tests() {
     test_line_graph();
     test_star_graph();
     test_original_example_tree();
+    test_batch_queries();
+    test_c_api_batch();
+    test_c_api_rejects_non_trees();
+    test_randomized_differential();
+    test_dynamic_diameter();
+    test_time_windowed_path_counts();
+    test_path_labels();
+    test_lca_of_set_and_ancestor_batch();
+    test_chrome_trace_output();
+    test_prometheus_metrics();
+    test_compressed_archive();
+    test_online_ancestor_index();
+    test_subtree_order_statistics();
+    test_shared_subtree_decomposition();
+    test_forkable_hld();
+    test_offline_path_max();
+    test_auto_tuner();
+    test_mixed_batch_executor();
+    test_path_topk();
+    test_path_distinct();
+    test_path_quantile();
+    test_concurrent_edge_ingestion();
+    test_build_from_nested_sets();
+    test_succinct_tree();
+    test_level_subtree_index();
+    test_path_xor_basis();
+#ifdef HLD_HAS_COROUTINES
+    test_query_path_async();
+#endif
     cout << "--- All HLD Tests Completed ---" << endl;
 }
 
@@ -473,4 +5693,5 @@ int main() {
     run_hld_sample();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif // HLD_NO_MAIN
@@ -0,0 +1,75 @@
+#ifndef HLD_C_API_H
+#define HLD_C_API_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define HLD_API __declspec(dllexport)
+#else
+#define HLD_API __attribute__((visibility("default")))
+#endif
+
+/* Status codes returned by every function that does not return a handle. */
+#define HLD_OK 0
+#define HLD_ERR_INVALID_ARGUMENT (-1) /* Null pointer, node id out of range, or edges that are not a tree. */
+#define HLD_ERR_BAD_STATE (-2)        /* Query before hld_build, or edges after it. */
+#define HLD_ERR_OUT_OF_MEMORY (-3)
+
+/* Opaque handle owning one HLD instance. */
+typedef struct hld_handle hld_handle;
+
+/**
+ * Creates a tree with num_nodes nodes (0-indexed) and the given initial values.
+ * Returns NULL on invalid arguments or allocation failure.
+ */
+HLD_API hld_handle* hld_create(int num_nodes, const int* initial_values);
+
+/** Releases a handle created by hld_create. Accepts NULL. */
+HLD_API void hld_destroy(hld_handle* handle);
+
+/**
+ * Adds num_edges undirected edges given as a flat array {u0, v0, u1, v1, ...}.
+ * Must be called before hld_build.
+ */
+HLD_API int hld_add_edges(hld_handle* handle, const int* edges, size_t num_edges);
+
+/**
+ * Builds the decomposition rooted at root. Must be called exactly once.
+ * Returns HLD_ERR_INVALID_ARGUMENT, leaving the handle unbuilt, unless the edges added so far are exactly
+ * num_nodes - 1 edges connecting every node. After a rejected edge set the handle can only be destroyed.
+ */
+HLD_API int hld_build(hld_handle* handle, int root);
+
+/**
+ * Answers num_pairs path-sum queries given as a flat array {u0, v0, u1, v1, ...}.
+ * results must have room for num_pairs ints.
+ */
+HLD_API int hld_query_path_batch(hld_handle* handle, const int* pairs, size_t num_pairs, int* results);
+
+/** Answers num_pairs LCA queries laid out like hld_query_path_batch. */
+HLD_API int hld_get_lca_batch(hld_handle* handle, const int* pairs, size_t num_pairs, int* results);
+
+/** Writes the LCA of num_nodes (at least 1) nodes to *result. */
+HLD_API int hld_lca_of_set(hld_handle* handle, const int* nodes, size_t num_nodes, int* result);
+
+/**
+ * For each pair {ancestor, node} of a flat array laid out like hld_query_path_batch, writes 1 to
+ * results[i] if the first node is an ancestor of (or equal to) the second, else 0.
+ */
+HLD_API int hld_is_ancestor_batch(hld_handle* handle, const int* pairs, size_t num_pairs, unsigned char* results);
+
+/**
+ * Applies num_updates point assignments given as a flat array {node0, value0, node1, value1, ...},
+ * in order. Either every update is applied or, on an invalid node id, none is.
+ */
+HLD_API int hld_update_batch(hld_handle* handle, const int* updates, size_t num_updates);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HLD_C_API_H */